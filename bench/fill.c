@@ -0,0 +1,148 @@
+// Measures the time of flood fills on large canvases with the serial span fill, the parallel band
+// fill and flood_fill, which switches between them, to check PARALLEL_FILL_PIXELS and
+// PARALLEL_FILL_FRACTION. The fill sources are included directly, so that both versions can be
+// called regardless of the canvas size.
+#include <stdio.h>
+#include <SDL2/SDL.h>
+#include "../source/fill.c"
+
+enum {
+	TRIALS = 5, // The best time of this many fills is reported.
+};
+
+typedef void (*FillFunction)(Canvas *canvas, int x, int y, Color target, uint8_t tolerance, Color color);
+
+static void serial_only(Canvas *canvas, int x, int y, Color target, uint8_t tolerance, Color color)
+{
+	fill_serial(canvas, x, y, target, tolerance, color, SIZE_MAX);
+}
+
+static void automatic(Canvas *canvas, int x, int y, Color target, uint8_t tolerance, Color color)
+{
+	flood_fill(canvas, x, y, color, tolerance);
+}
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void)
+{
+	random_state = random_state * 1103515245 + 12345;
+	return random_state >> 16;
+}
+
+// Draws a perfect maze with one pixel wide corridors and walls using a randomized depth-first
+// search. All corridors are connected, so a fill starting at (1, 1) has to visit every one of
+// them through a very large number of short spans.
+static void draw_maze(Color *pixels, int w, int h)
+{
+	Color const wall = 0x000000ff;
+	Color const floor = 0xffffffff;
+	for (int i = 0; i < w * h; ++i) {
+		pixels[i] = wall;
+	}
+	int cells_x = (w - 1) / 2;
+	int cells_y = (h - 1) / 2;
+	int *stack = xalloc(cells_x * cells_y * sizeof(int));
+	int size = 0;
+	stack[size++] = 0;
+	pixels[1 * w + 1] = floor;
+	while (size > 0) {
+		int cell = stack[size - 1];
+		int cx = cell % cells_x;
+		int cy = cell / cells_x;
+		int options[4];
+		int noptions = 0;
+		int const dx[] = {1, -1, 0, 0};
+		int const dy[] = {0, 0, 1, -1};
+		for (int d = 0; d < 4; ++d) {
+			int nx = cx + dx[d];
+			int ny = cy + dy[d];
+			if (nx >= 0 && ny >= 0 && nx < cells_x && ny < cells_y && pixels[(2 * ny + 1) * w + 2 * nx + 1] == wall) {
+				options[noptions++] = d;
+			}
+		}
+		if (noptions == 0) {
+			--size;
+			continue;
+		}
+		int d = options[next_random() % noptions];
+		int nx = cx + dx[d];
+		int ny = cy + dy[d];
+		pixels[(2 * cy + 1 + dy[d]) * w + 2 * cx + 1 + dx[d]] = floor;
+		pixels[(2 * ny + 1) * w + 2 * nx + 1] = floor;
+		stack[size++] = ny * cells_x + nx;
+	}
+	free(stack);
+}
+
+// Fills the canvas with a single color, so that the fill consists of one span per row.
+static void draw_solid(Color *pixels, int w, int h)
+{
+	for (int i = 0; i < w * h; ++i) {
+		pixels[i] = 0xffffffff;
+	}
+}
+
+// Encloses a small square at the top left corner of the canvas. The fill only changes a few
+// pixels, while the parallel fill still has to label the whole canvas.
+static void draw_box(Color *pixels, int w, int h)
+{
+	draw_solid(pixels, w, h);
+	for (int i = 0; i <= 32; ++i) {
+		pixels[32 * w + i] = 0x000000ff;
+		pixels[i * w + 32] = 0x000000ff;
+	}
+}
+
+// Returns the best time in milliseconds of filling the canvas from (1, 1). The uncommitted fill
+// is reverted after every trial.
+static double measure(Canvas *canvas, FillFunction fill)
+{
+	double best = 0;
+	for (int trial = 0; trial < TRIALS; ++trial) {
+		Uint64 start = SDL_GetPerformanceCounter();
+		fill(canvas, 1, 1, canvas->pixels[1 * canvas->w + 1], 0, 0xff0000ff);
+		double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+		canvas_undo(canvas);
+		if (trial == 0 || ms < best) {
+			best = ms;
+		}
+	}
+	return best;
+}
+
+int main(void)
+{
+	kernel_init();
+	SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, 1, 1, 32, SDL_PIXELFORMAT_RGBA8888);
+	SDL_Renderer *ren = surface != NULL ? SDL_CreateSoftwareRenderer(surface) : NULL;
+	if (ren == NULL) {
+		fatalSDL("SDL_CreateSoftwareRenderer");
+	}
+
+	struct {
+		char const *name;
+		void (*draw)(Color *pixels, int w, int h);
+	} const patterns[] = {{"maze", draw_maze}, {"solid", draw_solid}, {"box", draw_box}};
+	int const sizes[] = {512, 1024, 1448, 2048, 4096};
+
+	printf("%d threads, parallel fill from %d pixels and 1/%d of the canvas\n",
+		MIN(MAX(SDL_GetCPUCount(), 1), MAX_FILL_THREADS), PARALLEL_FILL_PIXELS, PARALLEL_FILL_FRACTION);
+	printf("%-8s %10s %12s %14s %16s\n", "pattern", "size", "serial ms", "parallel ms", "flood_fill ms");
+	for (size_t p = 0; p < LENGTH(patterns); ++p) {
+		for (size_t s = 0; s < LENGTH(sizes); ++s) {
+			int n = sizes[s];
+			Canvas canvas = canvas_create_with_background(n, n, 0, ren);
+			patterns[p].draw(canvas.pixels, n, n);
+			double serial = measure(&canvas, serial_only);
+			double parallel = measure(&canvas, fill_parallel);
+			double both = measure(&canvas, automatic);
+			printf("%-8s %4dx%-5d %12.1f %14.1f %16.1f\n", patterns[p].name, n, n, serial, parallel, both);
+			canvas_free(canvas);
+		}
+	}
+
+	SDL_DestroyRenderer(ren);
+	SDL_FreeSurface(surface);
+	return 0;
+}
@@ -0,0 +1,117 @@
+// Measures the throughput of every pixel row kernel in megapixels per second, once for each
+// instruction set the CPU supports. The kernel sources are included directly, so that the
+// scalar and vector versions can be called side by side.
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../source/kernel.c"
+
+enum {
+	SPAN_PIXELS = 16, // A row of a typical brush stamp.
+	ROW_PIXELS = 4096, // One row of a large canvas. Fits into the L1 and L2 caches.
+	CANVAS_PIXELS = 4096 * 4096, // A whole large canvas. Does not fit into any cache.
+};
+
+#define TRIALS 10
+#define TRIAL_SECONDS 0.05
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+
+typedef struct {
+	char const *name;
+	FillKernel fill;
+	MatchKernel match;
+	ReplaceKernel replace;
+	ToRgbaKernel to_rgba;
+} KernelSet;
+
+static uint32_t *pixels;
+static uint8_t *bytes;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fills the pixels with a pattern in which about half of the pixels match the target color of
+// the match and replace measurements.
+static void reset_pixels(int n)
+{
+	uint32_t state = 12345;
+	for (int i = 0; i < n; ++i) {
+		state = state * 1103515245 + 12345;
+		pixels[i] = (state >> 16) & 1 ? 0x336699ff : state;
+	}
+}
+
+// Runs the kernel on rows of width pixels until n pixels have been processed. Returns the best
+// throughput of TRIALS runs in megapixels per second, which filters out interruptions by other
+// processes.
+static double measure(KernelSet const *set, char op, int width, int n)
+{
+	reset_pixels(n);
+	double best = 0;
+	for (int trial = 0; trial < TRIALS; ++trial) {
+		long long processed = 0;
+		double start = now();
+		double elapsed;
+		do {
+			for (int row = 0; row < n; row += width) {
+				uint32_t *p = &pixels[row];
+				switch (op) {
+				case 'f': set->fill(p, width, 0x336699ff); break;
+				case 'm': set->match(p, width, 0x336699ff, 8, &bytes[row]); break;
+				// Swapping back and forth keeps the amount of matching pixels constant.
+				case 'r': set->replace(p, width, 0x336699ff, 0x996633ff); set->replace(p, width, 0x996633ff, 0x336699ff); break;
+				case 't': set->to_rgba(&bytes[4 * row], p, width); break;
+				}
+			}
+			processed += op == 'r' ? 2LL * n : n;
+			elapsed = now() - start;
+		} while (elapsed < TRIAL_SECONDS);
+		best = MAX(best, processed / elapsed / 1e6);
+	}
+	return best;
+}
+
+int main(void)
+{
+	pixels = malloc(CANVAS_PIXELS * sizeof(uint32_t));
+	bytes = malloc(CANVAS_PIXELS * sizeof(uint32_t));
+	if (pixels == NULL || bytes == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	KernelSet sets[3] = {{"scalar", fill_scalar, match_scalar, replace_scalar, to_rgba_scalar}};
+	int nsets = 1;
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		sets[nsets++] = (KernelSet) {"sse2", fill_scalar, match_sse2, replace_sse2, to_rgba_sse2};
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		sets[nsets++] = (KernelSet) {"avx2", fill_avx2, match_avx2, replace_avx2, to_rgba_avx2};
+	}
+#endif
+
+	struct {
+		char op;
+		char const *name;
+	} const ops[] = {{'f', "fill"}, {'m', "match"}, {'r', "replace"}, {'t', "to_rgba"}};
+
+	printf("%-8s %-8s %14s %14s %14s\n", "kernel", "isa", "span MP/s", "row MP/s", "canvas MP/s");
+	for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); ++i) {
+		for (int s = 0; s < nsets; ++s) {
+			double span = measure(&sets[s], ops[i].op, SPAN_PIXELS, ROW_PIXELS);
+			double row = measure(&sets[s], ops[i].op, ROW_PIXELS, ROW_PIXELS);
+			double canvas = measure(&sets[s], ops[i].op, ROW_PIXELS, CANVAS_PIXELS);
+			printf("%-8s %-8s %14.0f %14.0f %14.0f\n", ops[i].name, sets[s].name, span, row, canvas);
+		}
+	}
+	free(pixels);
+	free(bytes);
+	return 0;
+}
@@ -6,6 +6,72 @@
 
 enum { MIN_STENCIL_BYTES = 12 * 12 };
 
+static void add_edge(Brush *brush, BrushEdge edge)
+{
+	if (brush->noutline == brush->outline_cap) {
+		brush->outline_cap = MAX(16, brush->outline_cap * 2);
+		brush->outline = xrealloc(brush->outline, brush->outline_cap * sizeof(BrushEdge));
+	}
+	brush->outline[brush->noutline++] = edge;
+}
+
+// Collects the edges of the stencil into the outline array. Neighbouring edges are merged into
+// longer lines. The pads make sure that the lines join at the corners without overlapping.
+static void trace_outline(Brush *brush)
+{
+	int const size = brush->size;
+	uint8_t const *stencil = brush->stencil;
+	brush->noutline = 0;
+
+	// Horizontal edges
+	for (int y = 0; y <= size; ++y) {
+		BrushEdge edge = {0};
+		bool open = false;
+		bool left = false;
+		for (int x = 0; x <= size; ++x) {
+			bool cur = x < size && y < size && stencil[y * size + x];
+			bool top = y > 0 && x < size && stencil[(y - 1) * size + x];
+			if (open && (cur == top || cur != left)) {
+				edge.x1 = x;
+				edge.y1 = y;
+				edge.end_pad = cur ? 0 : 1;
+				edge.side = left ? -1 : 1;
+				add_edge(brush, edge);
+				open = false;
+			}
+			if (cur != top && !open) {
+				edge = (BrushEdge) {.x0 = x, .y0 = y, .start_pad = left ? 0 : -1};
+				open = true;
+			}
+			left = cur;
+		}
+	}
+
+	// Vertical edges
+	for (int x = 0; x <= size; ++x) {
+		BrushEdge edge = {0};
+		bool open = false;
+		bool top = false;
+		for (int y = 0; y <= size; ++y) {
+			bool cur = x < size && y < size && stencil[y * size + x];
+			bool left = x > 0 && y < size && stencil[y * size + x - 1];
+			if (open && (cur == left || cur != top)) {
+				edge.x1 = x;
+				edge.y1 = y;
+				edge.end_pad = cur ? -1 : 0;
+				edge.side = top ? -1 : 1;
+				add_edge(brush, edge);
+				open = false;
+			}
+			if (cur != left && !open) {
+				edge = (BrushEdge) {.x0 = x, .y0 = y, .start_pad = top ? 1 : 0};
+				open = true;
+			}
+			top = cur;
+		}
+	}
+}
+
 // The stencil buffer must have at least size * size elements.
 static void fill_stencil(uint8_t *stencil, int size, bool round)
 {
@@ -35,21 +101,51 @@ static void fill_stencil(uint8_t *stencil, int size, bool round)
 	}
 }
 
+// Finds the filled span in every row of the stencil.
+static void find_spans(Brush *brush)
+{
+	int const size = brush->size;
+	brush->spans = xrealloc(brush->spans, size * sizeof(BrushSpan));
+	for (int y = 0; y < size; ++y) {
+		uint8_t const *row = &brush->stencil[y * size];
+		int start = 0;
+		while (start < size && !row[start]) {
+			++start;
+		}
+		int end = start;
+		while (end < size && row[end]) {
+			++end;
+		}
+		brush->spans[y] = (BrushSpan) {start, end - start};
+		for (int x = end; x < size; ++x) {
+			assert(!row[x] && "Stencil rows must not have gaps");
+		}
+	}
+}
+
+// Regenerates the stencil, its spans and its outline after the size or shape of the brush has
+// changed.
+static void update_stencil(Brush *brush)
+{
+	fill_stencil(brush->stencil, brush->size, brush->round);
+	find_spans(brush);
+	trace_outline(brush);
+}
+
 Brush brush_create(int size, bool round)
 {
 	int sbytes = size * size;
 	if (sbytes < MIN_STENCIL_BYTES) {
 		sbytes = MIN_STENCIL_BYTES;
 	}
-	uint8_t *stencil = xalloc(sbytes);
-	fill_stencil(stencil, size, round);
-
-	return (Brush) {
+	Brush brush = {
 		.size = size,
 		.round = round,
-		.stencil = stencil,
+		.stencil = xalloc(sbytes),
 		.sbytes = sbytes
 	};
+	update_stencil(&brush);
+	return brush;
 }
 
 void brush_set_size(Brush *brush, int new_size)
@@ -79,7 +175,7 @@ void brush_set_size(Brush *brush, int new_size)
 		brush->stencil = xalloc(sbytes);
 	}
 	brush->size = new_size;
-	fill_stencil(brush->stencil, brush->size, brush->round);
+	update_stencil(brush);
 }
 
 void brush_resize(Brush *brush, int delta)
@@ -91,11 +187,13 @@ void brush_set_round(Brush *brush, bool round)
 {
 	if (round != brush->round) {
 		brush->round = round;
-		fill_stencil(brush->stencil, brush->size, round);
+		update_stencil(brush);
 	}
 }
 
 void brush_free(Brush brush)
 {
 	free(brush.stencil);
+	free(brush.spans);
+	free(brush.outline);
 }
@@ -3,11 +3,31 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// A straight piece of the brush outline. It runs along the border between two rows or columns of
+// the stencil and is stored in stencil coordinates, so it can be drawn at any zoom level.
+typedef struct {
+	int x0, y0; // Start of the edge.
+	int x1, y1; // End of the edge. The edge is horizontal if y0 == y1, otherwise vertical.
+	int8_t start_pad; // Moves the start of the line by this many line widths.
+	int8_t end_pad; // Moves the end of the line by this many line widths.
+	int8_t side; // The line is drawn above/left (-1) or below/right (1) of the edge.
+} BrushEdge;
+
+// Horizontal run of filled pixels in one row of the stencil.
+typedef struct {
+	int start;
+	int len;
+} BrushSpan;
+
 typedef struct {
 	int size;
 	bool round;
 	uint8_t *stencil; // Holds at least size*size elements
 	int sbytes; // Number of bytes allocated for the stencil buffer.
+	BrushSpan *spans; // [size] All stencils are convex, so every row consists of a single span.
+	BrushEdge *outline; // Edges between pixels inside and outside of the stencil.
+	int noutline;
+	int outline_cap; // Number of elements allocated for the outline array.
 } Brush;
 
 // Returns a new brush with the specified parameters.
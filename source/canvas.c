@@ -1,25 +1,136 @@
 #include <assert.h>
 #include "canvas.h"
 #include "util.h"
-#include "dialog.h"
+#include "lz.h"
+
+// Number of undo points around the current history position which are never compressed by
+// canvas_compact_history, so that stepping through recent history stays fast.
+enum { HOT_HISTORY_LENGTH = 8 };
+
+// Number of bytes compressed by a single canvas_compact_history call, so that it returns quickly
+// enough to not delay input events.
+enum { COMPACT_STEP_BYTES = 256 << 10 };
+
+// Maximum amount of undo data in the journal in megabytes. Once the journal is full, the oldest undo
+// points are discarded instead.
+enum { JOURNAL_BUDGET_MB = 4096 };
+
+struct Tile {
+	// Copy of the tile's pixels before the first modification since the last commit. NULL if
+	// the tile has not been touched yet. Pixels are stored in rows of TILE_SIZE elements.
+	Color *backup;
+	// Part of the tile modified since the last commit in canvas coordinates. Always empty if
+	// the tile has not been touched.
+	SDL_Rect dirty;
+	// Part of the tile which has not been uploaded to the texture yet.
+	SDL_Rect stale;
+};
+
+struct UndoPoint {
+	size_t size; // Size of the data array in bytes
+	size_t raw_size; // Size of the data after decompression. Equal to size if not compressed.
+	bool cold; // Has already been visited by canvas_compact_history.
+	bool spilled; // Data has been moved to the journal. The data pointer is NULL in this case.
+	size_t offset; // Position of the data inside the journal if spilled.
+	// Sequence of patches. Every patch is an SDL_Rect immediately followed by the previous
+	// contents of this rectangle encoded by a DiffEncoder (see below). The whole sequence may
+	// be additionally compressed with lz_compress.
+	unsigned char *data;
+};
+
+struct Compaction {
+	UndoPoint *up; // Undo point being compressed. NULL if no compression is in progress.
+	unsigned char *packed; // [lz_bound(up->size)]
+	LzStream stream;
+};
+
+// Stops the compression of the undo point if canvas_compact_history is working on it. Must be
+// called before the data of the undo point is changed or freed.
+static void cancel_compaction(Canvas *canvas, UndoPoint *up)
+{
+	Compaction *c = canvas->compaction;
+	if (c != NULL && c->up == up) {
+		free(c->packed);
+		c->packed = NULL;
+		c->up = NULL;
+	}
+}
+
+// Returns the total amount of memory occupied by the undo point.
+static size_t undo_point_bytes(UndoPoint const *up)
+{
+	return sizeof(UndoPoint) + (up->spilled ? 0 : up->size);
+}
+
+static void free_undo_point(Canvas *canvas, UndoPoint *up)
+{
+	if (up != NULL) {
+		cancel_compaction(canvas, up);
+		if (up->spilled) {
+			journal_release(canvas->journal, up->offset, up->size);
+		}
+		free(up->data);
+		free(up);
+	}
+}
+
+// Returns the side length of the textures used to display a canvas. Large canvases are split into
+// a grid of textures because their size may exceed the maximum texture size of the renderer.
+static int texture_size(SDL_Renderer *ren)
+{
+	int size = MAX_TEXTURE_SIZE;
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(ren, &info) == 0) {
+		if (info.max_texture_width > 0) {
+			size = MIN(size, info.max_texture_width);
+		}
+		if (info.max_texture_height > 0) {
+			size = MIN(size, info.max_texture_height);
+		}
+	}
+	// Every tile must be displayed by exactly one texture.
+	return MAX(TILE_SIZE, size / TILE_SIZE * TILE_SIZE);
+}
 
 Canvas canvas_create_from_memory(int w, int h, Color *pixels, SDL_Renderer *ren)
 {
 	assert(w > 0 && h > 0);
-	SDL_Texture *texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, w, h);
-	if (texture == NULL) {
-		fatalSDL("SDL_CreateTexture");
+	int size = texture_size(ren);
+	int textures_x = (w + size - 1) / size;
+	int textures_y = (h + size - 1) / size;
+	SDL_Texture **textures = xalloc(textures_x * textures_y * sizeof(SDL_Texture *));
+	for (int ty = 0; ty < textures_y; ++ty) {
+		for (int tx = 0; tx < textures_x; ++tx) {
+			int x = tx * size;
+			int y = ty * size;
+			SDL_Texture *texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888,
+				SDL_TEXTUREACCESS_STREAMING, MIN(size, w - x), MIN(size, h - y));
+			if (texture == NULL) {
+				fatalSDL("SDL_CreateTexture");
+			}
+			int pitch = w * sizeof(Color);
+			SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+			SDL_UpdateTexture(texture, NULL, &pixels[y * w + x], pitch);
+			textures[ty * textures_x + tx] = texture;
+		}
 	}
-	int pitch = w * sizeof(Color);
-	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
-	SDL_UpdateTexture(texture, NULL, pixels, pitch);
 
+	int tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
 	return (Canvas) {
 		.w = w,
 		.h = h,
-		.texture = texture,
+		.textures = textures,
+		.texture_size = size,
+		.textures_x = textures_x,
+		.textures_y = textures_y,
 		.pixels = pixels,
-		.pixels_backup = xmemdup(pixels, w * h * sizeof(Color))
+		.tiles_x = tiles_x,
+		.tiles_y = tiles_y,
+		.tiles = xalloc(tiles_x * tiles_y * sizeof(Tile)),
+		.touched = xalloc(tiles_x * tiles_y * sizeof(int)),
+		.stale = xalloc(tiles_x * tiles_y * sizeof(int)),
+		.history_budget = DEFAULT_HISTORY_BUDGET
 	};
 }
 
@@ -33,272 +144,651 @@ Canvas canvas_create_with_background(int w, int h, Color bg, SDL_Renderer *ren)
 	return canvas_create_from_memory(w, h, pixels, ren);
 }
 
-// Define these functions here to not include the huge header file.
-typedef unsigned char stbi_uc;
-stbi_uc *stbi_load(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
-const char *stbi_failure_reason(void);
-
-char const *canvas_open_image(Canvas *out_result, char const *filepath, SDL_Renderer *ren)
+void canvas_free(Canvas c)
 {
-	memset(out_result, 0, sizeof(*out_result));
-	int width = 0;
-	int height = 0;
-	uint32_t *rgba = (uint32_t *) stbi_load(filepath, &width, &height, NULL, 4);
-	if (rgba == NULL) {
-		return stbi_failure_reason();
+	for (int i = 0; c.textures != NULL && i < c.textures_x * c.textures_y; ++i) {
+		SDL_DestroyTexture(c.textures[i]);
 	}
-	if (width == 0 || height == 0) {
-		// No idea if this can actually happen :/
-		free(rgba);
-		return "Empty image";
+	free(c.textures);
+	free(c.pixels);
+	for (int i = 0; i < c.ntouched; ++i) {
+		free(c.tiles[c.touched[i]].backup);
 	}
-
-	// Convert endianness
-	for (int i = 0; i < width * height; ++i) {
-		rgba[i] = SDL_SwapBE32(rgba[i]);
+	free(c.tiles);
+	free(c.touched);
+	free(c.stale);
+	for (int i = 0; i < c.undo_left + c.redo_left; ++i) {
+		free_undo_point(&c, c.history[i]);
 	}
-
-	*out_result = canvas_create_from_memory(width, height, rgba, ren);
-	out_result->filepath = xstrdup(filepath);
-	return NULL;
+	free(c.history);
+	journal_close(c.journal);
+	if (c.compaction != NULL) {
+		free(c.compaction->packed);
+		free(c.compaction);
+	}
+	free((char *) c.filepath);
 }
 
-void canvas_free(Canvas c)
+// Clips the region to the canvas bounds. Returns false if the resulting region is empty.
+static bool clip_region(Canvas const *canvas, SDL_Rect *region)
 {
-	if (c.texture != NULL) {
-		SDL_DestroyTexture(c.texture);
+	// Normalize negative side length. SDL_Rect functions do not handle them well.
+	if (region->w < 0) {
+		region->x += region->w;
+		region->w = -region->w;
 	}
-	free(c.pixels);
-	free(c.pixels_backup);
-	for (size_t i = 0; i < LENGTH(c.history); ++i) {
-		free(c.history[i]);
+	if (region->h < 0) {
+		region->y += region->h;
+		region->h = -region->h;
 	}
-	free((char *) c.filepath);
+
+	SDL_Rect bounds = {0, 0, canvas->w, canvas->h};
+	return SDL_IntersectRect(region, &bounds, region);
 }
 
-// Uploads pixels in the specified region to the texture.
-static void update_texture(Canvas *canvas, SDL_Rect rect)
+// Returns the part of the canvas covered by the tile with the specified index.
+static SDL_Rect tile_rect(Canvas const *canvas, int index)
 {
-	unsigned char *tex_data = NULL;
-	int pitch = 0; // Row length in bytes
-	if (SDL_LockTexture(canvas->texture, &rect, (void **) &tex_data, &pitch) != 0) {
-		fatalSDL("SDL_LockTexture");
-	}
-	for (int y = rect.y; y < rect.y + rect.h; ++y) {
-		void *dest = &tex_data[(y - rect.y) * pitch];
-		void *src = &canvas->pixels[y * canvas->w + rect.x];
-		memcpy(dest, src, rect.w * sizeof(Color));
+	int x = index % canvas->tiles_x * TILE_SIZE;
+	int y = index / canvas->tiles_x * TILE_SIZE;
+	return (SDL_Rect) {x, y, MIN(TILE_SIZE, canvas->w - x), MIN(TILE_SIZE, canvas->h - y)};
+}
+
+// Remembers that the texture is out of date inside the specified region, which must lie within
+// the canvas bounds. The texture is updated by the next call to canvas_flush_texture.
+static void invalidate_texture(Canvas *canvas, SDL_Rect region)
+{
+	for (int ty = region.y / TILE_SIZE; ty <= (region.y + region.h - 1) / TILE_SIZE; ++ty) {
+		for (int tx = region.x / TILE_SIZE; tx <= (region.x + region.w - 1) / TILE_SIZE; ++tx) {
+			int index = ty * canvas->tiles_x + tx;
+			Tile *tile = &canvas->tiles[index];
+			if (SDL_RectEmpty(&tile->stale)) {
+				assert(canvas->nstale < canvas->tiles_x * canvas->tiles_y);
+				canvas->stale[canvas->nstale++] = index;
+			}
+			SDL_Rect bounds = tile_rect(canvas, index);
+			SDL_Rect rect;
+			SDL_IntersectRect(&bounds, &region, &rect);
+			SDL_UnionRect(&tile->stale, &rect, &tile->stale);
+		}
 	}
-	SDL_UnlockTexture(canvas->texture);
 	canvas->unsaved = true;
+	++canvas->version;
 }
 
-void canvas_mark_dirty(Canvas *canvas, SDL_Rect region)
+// Uploads pixels in the specified region to the textures.
+static void update_texture(Canvas *canvas, SDL_Rect region)
 {
-	// Normalize negative side length. SDL_Rect functions do not handle them well.
-	if (region.w < 0) {
-		region.x += region.w;
-		region.w = -region.w;
+	int size = canvas->texture_size;
+	for (int ty = region.y / size; ty <= (region.y + region.h - 1) / size; ++ty) {
+		for (int tx = region.x / size; tx <= (region.x + region.w - 1) / size; ++tx) {
+			SDL_Rect bounds = {tx * size, ty * size, size, size};
+			SDL_Rect rect;
+			SDL_IntersectRect(&bounds, &region, &rect);
+			SDL_Rect local = {rect.x - bounds.x, rect.y - bounds.y, rect.w, rect.h};
+
+			SDL_Texture *texture = canvas->textures[ty * canvas->textures_x + tx];
+			unsigned char *tex_data = NULL;
+			int pitch = 0; // Row length in bytes
+			if (SDL_LockTexture(texture, &local, (void **) &tex_data, &pitch) != 0) {
+				fatalSDL("SDL_LockTexture");
+			}
+			for (int y = rect.y; y < rect.y + rect.h; ++y) {
+				void *dest = &tex_data[(y - rect.y) * pitch];
+				void *src = &canvas->pixels[y * canvas->w + rect.x];
+				memcpy(dest, src, rect.w * sizeof(Color));
+			}
+			SDL_UnlockTexture(texture);
+			canvas->uploaded_bytes += rect.w * rect.h * sizeof(Color);
+		}
 	}
-	if (region.h < 0) {
-		region.y += region.h;
-		region.h = -region.h;
+}
+
+void canvas_flush_texture(Canvas *canvas)
+{
+	canvas->uploaded_bytes = 0;
+	memset(&canvas->uploaded_region, 0, sizeof(canvas->uploaded_region));
+	if (canvas->nstale == 0) {
+		return;
 	}
 
-	SDL_Rect bounds = {0, 0, canvas->w, canvas->h};
-	if (SDL_IntersectRect(&region, &bounds, &region)) {
-		// Note that this branch is not entered if the provided region is empty.
-		SDL_UnionRect(&canvas->dirty, &region, &canvas->dirty);
-		update_texture(canvas, region);
+	SDL_Rect bbox = {0};
+	size_t area = 0;
+	for (int i = 0; i < canvas->nstale; ++i) {
+		SDL_Rect stale = canvas->tiles[canvas->stale[i]].stale;
+		SDL_UnionRect(&bbox, &stale, &bbox);
+		area += stale.w * stale.h;
 	}
+	// If the stale regions are close together, upload all of them with a single lock. This is
+	// much cheaper than locking every tile after large operations like an undo.
+	bool merge = (size_t) bbox.w * bbox.h <= 2 * area;
+	canvas->uploaded_region = bbox;
+	if (merge) {
+		update_texture(canvas, bbox);
+	}
+	for (int i = 0; i < canvas->nstale; ++i) {
+		Tile *tile = &canvas->tiles[canvas->stale[i]];
+		if (!merge) {
+			update_texture(canvas, tile->stale);
+		}
+		memset(&tile->stale, 0, sizeof(tile->stale));
+	}
+	canvas->nstale = 0;
 }
 
-struct UndoPoint {
-	SDL_Rect affected;
-	Color data[];
-};
+void canvas_touch(Canvas *canvas, SDL_Rect region)
+{
+	if (!clip_region(canvas, &region)) {
+		return;
+	}
 
-void canvas_commit(Canvas *canvas)
+	for (int ty = region.y / TILE_SIZE; ty <= (region.y + region.h - 1) / TILE_SIZE; ++ty) {
+		for (int tx = region.x / TILE_SIZE; tx <= (region.x + region.w - 1) / TILE_SIZE; ++tx) {
+			int index = ty * canvas->tiles_x + tx;
+			Tile *tile = &canvas->tiles[index];
+			if (tile->backup != NULL) {
+				continue;
+			}
+			SDL_Rect rect = tile_rect(canvas, index);
+			tile->backup = xalloc(TILE_SIZE * TILE_SIZE * sizeof(Color));
+			for (int y = 0; y < rect.h; ++y) {
+				void *src = &canvas->pixels[(rect.y + y) * canvas->w + rect.x];
+				memcpy(&tile->backup[y * TILE_SIZE], src, rect.w * sizeof(Color));
+			}
+			assert(canvas->ntouched < canvas->tiles_x * canvas->tiles_y);
+			canvas->touched[canvas->ntouched++] = index;
+		}
+	}
+}
+
+void canvas_mark_dirty(Canvas *canvas, SDL_Rect region)
 {
-	SDL_Rect dirty = canvas->dirty;
-	if (dirty.w == 0 || dirty.h == 0) {
-		// Do not commit empty regions.
+	if (!clip_region(canvas, &region)) {
 		return;
 	}
-	int npixels = dirty.w * dirty.h;
-	assert(npixels > 0);
-
-	UndoPoint *up = xalloc(sizeof(UndoPoint) + npixels * sizeof(Color));
-	up->affected = dirty;
-	for (int y = dirty.y, i = 0; y < dirty.y + dirty.h; ++y) {
-		for (int x = dirty.x; x < dirty.x + dirty.w; ++x) {
-			int ci = y * canvas->w + x;
-			assert(i < npixels);
-			up->data[i++] = canvas->pixels_backup[ci];
-			canvas->pixels_backup[ci] = canvas->pixels[ci];
+
+	for (int ty = region.y / TILE_SIZE; ty <= (region.y + region.h - 1) / TILE_SIZE; ++ty) {
+		for (int tx = region.x / TILE_SIZE; tx <= (region.x + region.w - 1) / TILE_SIZE; ++tx) {
+			int index = ty * canvas->tiles_x + tx;
+			Tile *tile = &canvas->tiles[index];
+			assert(tile->backup != NULL && "canvas_touch must be called before modifying pixels");
+			SDL_Rect bounds = tile_rect(canvas, index);
+			SDL_Rect rect;
+			SDL_IntersectRect(&bounds, &region, &rect);
+			SDL_UnionRect(&tile->dirty, &rect, &tile->dirty);
 		}
 	}
+	invalidate_texture(canvas, region);
+}
 
-	for (int i = 0; i < canvas->redo_left; ++i) {
-		int j = (canvas->next_hist + i) % MAX_UNDO_LENGTH;
-		free(canvas->history[j]);
-		canvas->history[j] = NULL;
+// Frees the backups of all touched tiles and clears their dirty regions.
+static void release_tiles(Canvas *canvas)
+{
+	for (int i = 0; i < canvas->ntouched; ++i) {
+		Tile *tile = &canvas->tiles[canvas->touched[i]];
+		free(tile->backup);
+		tile->backup = NULL;
+		memset(&tile->dirty, 0, sizeof(tile->dirty));
 	}
-	canvas->redo_left = 0;
-	free(canvas->history[canvas->next_hist]);
-	canvas->history[canvas->next_hist] = up;
-	canvas->next_hist = (canvas->next_hist + 1) % MAX_UNDO_LENGTH;
-	if (canvas->undo_left < MAX_UNDO_LENGTH) {
-		++canvas->undo_left;
+	canvas->ntouched = 0;
+}
+
+// Growable byte buffer used to encode undo points.
+typedef struct {
+	unsigned char *data;
+	size_t size;
+	size_t cap;
+} Buffer;
+
+static void buffer_put(Buffer *b, void const *data, size_t n)
+{
+	if (b->size + n > b->cap) {
+		b->cap = MAX(b->size + n, MAX(b->cap * 2, 256));
+		b->data = xrealloc(b->data, b->cap);
 	}
-	memset(&canvas->dirty, 0, sizeof(canvas->dirty));
+	memcpy(b->data + b->size, data, n);
+	b->size += n;
 }
 
-// Reverts any changes made to the dirty region after the last commit. The region itself will be
-// reset to zero.
-static void revert_uncommited_changes(Canvas *canvas)
+// Appends an unsigned LEB128 number.
+static void buffer_put_varint(Buffer *b, size_t value)
 {
-	SDL_Rect dirty = canvas->dirty;
-	if (dirty.w != 0 && dirty.h != 0) {
-		for (int y = dirty.y; y < dirty.y + dirty.h; ++y) {
-			for (int x = dirty.x; x < dirty.x + dirty.w; ++x) {
-				int i = y * canvas->w + x;
-				canvas->pixels[i] = canvas->pixels_backup[i];
-			}
+	unsigned char bytes[16];
+	int n = 0;
+	do {
+		bytes[n] = value & 0x7f;
+		value >>= 7;
+		if (value != 0) {
+			bytes[n] |= 0x80;
 		}
-		update_texture(canvas, dirty);
+		++n;
+	} while (value != 0);
+	buffer_put(b, bytes, n);
+}
+
+static size_t read_varint(unsigned char const **p)
+{
+	size_t value = 0;
+	int shift = 0;
+	unsigned char byte;
+	do {
+		byte = *(*p)++;
+		value |= (size_t) (byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return value;
+}
+
+// Encodes the previous contents of a patch as a difference to its current contents. The output
+// consists of varints (count << 1 | kind). Kind 0 skips count unchanged pixels, while kind 1
+// sets count pixels to the color stored in the following four bytes.
+typedef struct {
+	Buffer *out;
+	int skip; // Length of the pending run of unchanged pixels
+	int run; // Length of the pending run of changed pixels with the same color
+	Color color;
+	bool changed; // At least one changed pixel has been encoded.
+} DiffEncoder;
+
+static void diff_flush(DiffEncoder *e)
+{
+	if (e->skip > 0) {
+		buffer_put_varint(e->out, (size_t) e->skip << 1);
+		e->skip = 0;
+	}
+	if (e->run > 0) {
+		buffer_put_varint(e->out, (size_t) e->run << 1 | 1);
+		buffer_put(e->out, &e->color, sizeof(e->color));
+		e->run = 0;
 	}
-	memset(&canvas->dirty, 0, sizeof(canvas->dirty));
 }
 
-// Swaps pixels in the region specified by up->affected between the canvas's buffer and the undo
-// point's data.
-static void swap_pixels(Canvas *canvas, UndoPoint *up)
+static void diff_skip(DiffEncoder *e, int count)
 {
-	int i = 0;
-	for (int y = up->affected.y; y < up->affected.y + up->affected.h; ++y) {
-		for (int x = up->affected.x; x < up->affected.x + up->affected.w; ++x) {
-			Color temp = canvas->pixels[y * canvas->w + x];
-			canvas->pixels[y * canvas->w + x] = up->data[i];
-			canvas->pixels_backup[y * canvas->w + x] = up->data[i];
-			up->data[i++] = temp;
-		}
+	if (e->run > 0) {
+		diff_flush(e);
 	}
-	update_texture(canvas, up->affected);
+	e->skip += count;
 }
 
-bool canvas_undo(Canvas *canvas)
+static void diff_set(DiffEncoder *e, Color color)
 {
-	assert(canvas->undo_left >= 0 && canvas->undo_left <= MAX_UNDO_LENGTH);
-	assert(canvas->redo_left >= 0 && canvas->redo_left <= MAX_UNDO_LENGTH);
+	if (e->skip > 0 || (e->run > 0 && e->color != color)) {
+		diff_flush(e);
+	}
+	e->color = color;
+	e->changed = true;
+	++e->run;
+}
 
-	revert_uncommited_changes(canvas);
+// Tries to compress the data of the undo point with lz_compress. Does nothing if the undo point
+// has been compressed before.
+static void compress_undo_point(Canvas *canvas, UndoPoint *up)
+{
+	if (up->cold) {
+		return;
+	}
+	cancel_compaction(canvas, up);
+	up->cold = true;
+	unsigned char *packed = xalloc(lz_bound(up->size));
+	size_t packed_size = lz_compress(up->data, up->size, packed);
+	if (packed_size >= up->size) {
+		free(packed);
+		return;
+	}
+	canvas->history_bytes -= undo_point_bytes(up);
+	free(up->data);
+	up->data = xrealloc(packed, packed_size);
+	up->size = packed_size;
+	canvas->history_bytes += undo_point_bytes(up);
+}
 
-	if (canvas->undo_left == 0) {
+// Moves the data of the undo point to the journal. Returns false if the journal is not available
+// or has no room left for the undo point.
+static bool spill_undo_point(Canvas *canvas, UndoPoint *up)
+{
+	if (up->spilled) {
+		return true;
+	}
+	if (canvas->journal == NULL) {
+		canvas->journal = journal_open();
+		if (canvas->journal == NULL) {
+			return false;
+		}
+	}
+	compress_undo_point(canvas, up);
+	if (journal_size(canvas->journal) + up->size > (size_t) JOURNAL_BUDGET_MB << 20) {
 		return false;
 	}
-	--canvas->undo_left;
-	++canvas->redo_left;
-
-	if (canvas->next_hist == 0) {
-		// Wrap over
-		canvas->next_hist = MAX_UNDO_LENGTH - 1;
-	} else {
-		--canvas->next_hist;
+	size_t offset = 0;
+	if (!journal_write(canvas->journal, up->data, up->size, &offset)) {
+		return false;
 	}
-	swap_pixels(canvas, canvas->history[canvas->next_hist]);
+	canvas->history_bytes -= undo_point_bytes(up);
+	free(up->data);
+	up->data = NULL;
+	up->spilled = true;
+	up->offset = offset;
+	canvas->history_bytes += undo_point_bytes(up);
 	return true;
 }
 
-bool canvas_redo(Canvas *canvas)
+// Frees the n oldest undo points.
+static void free_oldest_history(Canvas *canvas, int n)
 {
-	assert(canvas->undo_left >= 0 && canvas->undo_left <= MAX_UNDO_LENGTH);
-	assert(canvas->redo_left >= 0 && canvas->redo_left <= MAX_UNDO_LENGTH);
+	if (n == 0) {
+		return;
+	}
+	for (int i = 0; i < n; ++i) {
+		canvas->history_bytes -= undo_point_bytes(canvas->history[i]);
+		free_undo_point(canvas, canvas->history[i]);
+	}
+	int remaining = canvas->undo_left + canvas->redo_left - n;
+	memmove(canvas->history, canvas->history + n, remaining * sizeof(UndoPoint *));
+	canvas->undo_left -= n;
+	canvas->compact_next = MAX(0, canvas->compact_next - n);
+}
 
-	revert_uncommited_changes(canvas);
+// Frees the oldest spilled undo points until the journal has room for the given number of bytes.
+// Returns the number of freed undo points.
+static int make_room_in_journal(Canvas *canvas, size_t size)
+{
+	size_t const budget = (size_t) JOURNAL_BUDGET_MB << 20;
+	size_t live = journal_size(canvas->journal);
+	int n = 0;
+	while (live + size > budget && n < canvas->undo_left - 1 && canvas->history[n]->spilled) {
+		live -= canvas->history[n]->size;
+		++n;
+	}
+	free_oldest_history(canvas, n);
+	return n;
+}
 
-	if (canvas->redo_left == 0) {
-		return false;
+// Moves undo points to the journal until the history fits into its budget again, starting with
+// the ones furthest away from the current position. The undo points right before and after the
+// current position always stay in memory. Once the journal is full, the oldest spilled undo points
+// are freed to make room. If the journal is unavailable, the oldest undo points are freed instead.
+static void discard_old_history(Canvas *canvas)
+{
+	int oldest = 0;
+	int newest = canvas->undo_left + canvas->redo_left - 1;
+	while (canvas->history_bytes > canvas->history_budget) {
+		int index;
+		if (oldest < canvas->undo_left - 1) {
+			index = oldest;
+		} else if (newest > canvas->undo_left) {
+			index = newest;
+		} else {
+			return;
+		}
+		UndoPoint *up = canvas->history[index];
+		if (!spill_undo_point(canvas, up)) {
+			if (canvas->journal == NULL) {
+				break;
+			}
+			int n = make_room_in_journal(canvas, up->size);
+			oldest -= n;
+			newest -= n;
+			index -= n;
+			if (n == 0 || !spill_undo_point(canvas, up)) {
+				break;
+			}
+		}
+		if (index == oldest) {
+			++oldest;
+		} else {
+			--newest;
+		}
 	}
-	++canvas->undo_left;
-	--canvas->redo_left;
 
-	swap_pixels(canvas, canvas->history[canvas->next_hist]);
-	canvas->next_hist = (canvas->next_hist + 1) % MAX_UNDO_LENGTH;
-	return true;
+	size_t bytes = canvas->history_bytes;
+	int n = 0;
+	while (bytes > canvas->history_budget && n < canvas->undo_left - 1) {
+		bytes -= undo_point_bytes(canvas->history[n]);
+		++n;
+	}
+	free_oldest_history(canvas, n);
 }
 
-int stbi_write_png(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
-int stbi_write_bmp(char const *filename, int w, int h, int comp, const void *data);
-int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
-// TODO: Implement my own functions to read and write PPM files. This image format is not properly
-// supported by stbi, but I find it useful because of its simplicity.
+// Moves the search position of canvas_compact_history back, so that undo points which have left
+// the hot part of the history are visited again. Must be called whenever the history changes.
+static void rewind_compaction(Canvas *canvas)
+{
+	int first_changed = MAX(0, canvas->undo_left - HOT_HISTORY_LENGTH - 1);
+	canvas->compact_next = MIN(canvas->compact_next, first_changed);
+}
 
-CanvasFileStatus canvas_save_to_file(Canvas *canvas, char const *filepath)
+void canvas_commit(Canvas *canvas)
 {
-	if (!canvas->unsaved && filepath == NULL && canvas->filepath != NULL) {
-		return CF_OK;
+	// Only the dirty regions of touched tiles can contain modified pixels.
+	Buffer out = {0};
+	for (int i = 0; i < canvas->ntouched; ++i) {
+		Tile *tile = &canvas->tiles[canvas->touched[i]];
+		SDL_Rect bounds = tile_rect(canvas, canvas->touched[i]);
+		SDL_Rect rect = tile->dirty;
+		if (SDL_RectEmpty(&rect)) {
+			continue;
+		}
+
+		size_t start = out.size;
+		buffer_put(&out, &rect, sizeof(rect));
+		DiffEncoder enc = {.out = &out};
+		for (int y = rect.y; y < rect.y + rect.h; ++y) {
+			Color const *before = &tile->backup[(y - bounds.y) * TILE_SIZE + rect.x - bounds.x];
+			Color const *after = &canvas->pixels[y * canvas->w + rect.x];
+			for (int x = 0; x < rect.w; ++x) {
+				if (before[x] == after[x]) {
+					diff_skip(&enc, 1);
+				} else {
+					diff_set(&enc, before[x]);
+				}
+			}
+		}
+		diff_flush(&enc);
+		if (!enc.changed) {
+			// The tool has overwritten pixels with identical colors.
+			out.size = start;
+		}
 	}
+	release_tiles(canvas);
+	if (out.size == 0) {
+		// Do not commit undo points without any changed pixel.
+		free(out.data);
+		return;
+	}
+
+	UndoPoint *up = xalloc(sizeof(UndoPoint));
+	up->size = out.size;
+	up->raw_size = out.size;
+	up->data = xrealloc(out.data, out.size);
 
-	if (filepath == NULL && canvas->filepath == NULL) {
-		filepath = dialog_save_file("Save File");
-		if (filepath == NULL) {
-			return CF_CANCELLED_BY_USER;
+	for (int i = 0; i < canvas->redo_left; ++i) {
+		UndoPoint *redo = canvas->history[canvas->undo_left + i];
+		canvas->history_bytes -= undo_point_bytes(redo);
+		free_undo_point(canvas, redo);
+	}
+	canvas->redo_left = 0;
+	if (canvas->undo_left == canvas->history_cap) {
+		canvas->history_cap = MAX(16, canvas->history_cap * 2);
+		canvas->history = xrealloc(canvas->history, canvas->history_cap * sizeof(UndoPoint *));
+	}
+	canvas->history[canvas->undo_left++] = up;
+	canvas->history_bytes += undo_point_bytes(up);
+	discard_old_history(canvas);
+	rewind_compaction(canvas);
+}
+
+// Reverts any changes made to the dirty regions after the last commit. The regions themselves
+// will be reset to zero.
+static void revert_uncommited_changes(Canvas *canvas)
+{
+	for (int i = 0; i < canvas->ntouched; ++i) {
+		Tile *tile = &canvas->tiles[canvas->touched[i]];
+		SDL_Rect bounds = tile_rect(canvas, canvas->touched[i]);
+		SDL_Rect rect = tile->dirty;
+		if (SDL_RectEmpty(&rect)) {
+			continue;
 		}
-	} else {
-		filepath = xstrdup(filepath == NULL ? canvas->filepath : filepath);
+		for (int y = rect.y; y < rect.y + rect.h; ++y) {
+			void *dest = &canvas->pixels[y * canvas->w + rect.x];
+			void *src = &tile->backup[(y - bounds.y) * TILE_SIZE + rect.x - bounds.x];
+			memcpy(dest, src, rect.w * sizeof(Color));
+		}
+		invalidate_texture(canvas, rect);
 	}
+	release_tiles(canvas);
+}
+
+// Applies the previous pixel values stored in the undo point to the canvas. Afterwards, the undo
+// point is re-encoded to contain the values which have just been overwritten, so that calling
+// this function twice restores the original state.
+static void swap_pixels(Canvas *canvas, UndoPoint *up)
+{
+	Buffer out = {0};
+	unsigned char const *p = up->data;
+	while (p < up->data + up->size) {
+		SDL_Rect rect;
+		memcpy(&rect, p, sizeof(rect));
+		p += sizeof(rect);
+		buffer_put(&out, &rect, sizeof(rect));
+
+		DiffEncoder enc = {.out = &out};
+		int x = 0;
+		int y = 0;
+		while (y < rect.h) {
+			size_t op = read_varint(&p);
+			int count = op >> 1;
+			if ((op & 1) == 0) {
+				diff_skip(&enc, count);
+				x += count;
+				y += x / rect.w;
+				x %= rect.w;
+				continue;
+			}
 
-	if (SDL_BYTEORDER == SDL_LIL_ENDIAN) {
-		// stbi expects the image data to be in the RGBA order. Therefore, we must do a conversion
-		// because we store pixels as endianness-dependent numbers.
-		for (int i = 0; i < canvas->w * canvas->h; ++i) {
-			canvas->pixels[i] = SDL_Swap32(canvas->pixels[i]);
+			Color color;
+			memcpy(&color, p, sizeof(color));
+			p += sizeof(color);
+			for (int i = 0; i < count; ++i) {
+				Color *pixel = &canvas->pixels[(rect.y + y) * canvas->w + rect.x + x];
+				diff_set(&enc, *pixel);
+				*pixel = color;
+				if (++x == rect.w) {
+					x = 0;
+					++y;
+				}
+			}
 		}
+		diff_flush(&enc);
+		invalidate_texture(canvas, rect);
 	}
+	assert(p == up->data + up->size);
 
-	int success = 0;
-	int unknown_format = 0;
-	char const *ext = strrchr(filepath, '.');
-	int const comp = 4; // RGBA
-	if (ext == NULL || strcmp(ext, ".png") == 0) {
-		success = stbi_write_png(filepath, canvas->w, canvas->h, comp, canvas->pixels, 0);
-	} else if (strcmp(ext, ".bmp") == 0 || strcmp(ext, ".dib") == 0) {
-		success = stbi_write_bmp(filepath, canvas->w, canvas->h, comp, canvas->pixels);
-	} else if (strcmp(ext, ".tga") == 0) {
-		success = stbi_write_tga(filepath, canvas->w, canvas->h, comp, canvas->pixels);
-	} else {
-		unknown_format = 1;
+	free(up->data);
+	up->data = out.size > 0 ? xrealloc(out.data, out.size) : out.data;
+	up->size = out.size;
+	up->raw_size = out.size;
+	up->cold = false;
+}
+
+// Swaps the pixels of the undo point at the given history index and updates the memory usage.
+static void apply_history(Canvas *canvas, int index)
+{
+	UndoPoint *up = canvas->history[index];
+	cancel_compaction(canvas, up);
+	canvas->history_bytes -= undo_point_bytes(up);
+	if (up->spilled) {
+		up->data = xalloc(up->size);
+		journal_read(canvas->journal, up->offset, up->size, up->data);
+		journal_release(canvas->journal, up->offset, up->size);
+		up->spilled = false;
+	}
+	if (up->size != up->raw_size) {
+		unsigned char *raw = xalloc(up->raw_size);
+		lz_decompress(up->data, up->size, raw);
+		free(up->data);
+		up->data = raw;
+		up->size = up->raw_size;
 	}
+	swap_pixels(canvas, up);
+	canvas->history_bytes += undo_point_bytes(up);
+}
 
-	if (SDL_BYTEORDER == SDL_LIL_ENDIAN) {
-		// Swap the bytes back to their original ordering.
-		for (int i = 0; i < canvas->w * canvas->h; ++i) {
-			canvas->pixels[i] = SDL_Swap32(canvas->pixels[i]);
+bool canvas_compact_history(Canvas *canvas)
+{
+	if (canvas->compaction == NULL) {
+		canvas->compaction = xalloc(sizeof(Compaction));
+	}
+	Compaction *c = canvas->compaction;
+	if (c->up == NULL) {
+		int len = canvas->undo_left + canvas->redo_left;
+		for (; canvas->compact_next < len; ++canvas->compact_next) {
+			int i = canvas->compact_next;
+			UndoPoint *up = canvas->history[i];
+			if (!up->cold && (i < canvas->undo_left - HOT_HISTORY_LENGTH || i >= canvas->undo_left + HOT_HISTORY_LENGTH)) {
+				c->up = up;
+				break;
+			}
+		}
+		if (c->up == NULL) {
+			return false;
 		}
+		c->packed = xalloc(lz_bound(c->up->size));
+		lz_stream_init(&c->stream);
 	}
 
-	if (success) {
-		free((char *) canvas->filepath);
-		canvas->filepath = filepath;
-		canvas->unsaved = false;
-		return CF_OK;
+	UndoPoint *up = c->up;
+	if (!lz_compress_step(&c->stream, up->data, up->size, c->packed, COMPACT_STEP_BYTES)) {
+		return true;
+	}
+	up->cold = true;
+	size_t packed_size = c->stream.out_size;
+	if (packed_size < up->size) {
+		canvas->history_bytes -= undo_point_bytes(up);
+		free(up->data);
+		up->data = xrealloc(c->packed, packed_size);
+		up->size = packed_size;
+		canvas->history_bytes += undo_point_bytes(up);
+	} else {
+		free(c->packed);
 	}
+	c->packed = NULL;
+	c->up = NULL;
+	return true;
+}
+
+bool canvas_undo(Canvas *canvas)
+{
+	assert(canvas->undo_left >= 0 && canvas->redo_left >= 0);
 
-	free((char *) filepath); // Filepath is now a copy. We have to free it.
-	if (unknown_format) {
-		return CF_UNKNOWN_IMAGE_FORMAT;
+	revert_uncommited_changes(canvas);
+
+	if (canvas->undo_left == 0) {
+		return false;
 	}
-	return CF_OTHER_ERROR;
+	--canvas->undo_left;
+	++canvas->redo_left;
+
+	apply_history(canvas, canvas->undo_left);
+	discard_old_history(canvas);
+	rewind_compaction(canvas);
+	return true;
 }
 
-CanvasFileStatus canvas_save_as_to_file(Canvas *canvas)
+bool canvas_redo(Canvas *canvas)
 {
-	char *filepath = dialog_save_file("Save File As");
-	if (filepath == NULL) {
-		return CF_CANCELLED_BY_USER;
+	assert(canvas->undo_left >= 0 && canvas->redo_left >= 0);
+
+	revert_uncommited_changes(canvas);
+
+	if (canvas->redo_left == 0) {
+		return false;
 	}
-	CanvasFileStatus status = canvas_save_to_file(canvas, filepath);
-	free(filepath); // canvas_save_to_file creates a copy of filepath.
-	return status;
+	apply_history(canvas, canvas->undo_left);
+
+	++canvas->undo_left;
+	--canvas->redo_left;
+	discard_old_history(canvas);
+	rewind_compaction(canvas);
+	return true;
 }
@@ -6,6 +6,7 @@
 #include <SDL2/SDL_rect.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "journal.h"
 
 typedef uint32_t Color; // RGBA
 
@@ -17,23 +18,49 @@ typedef uint32_t Color; // RGBA
 // Converts SDL_Color to Color
 #define COLOR_FROM(c) ((c.r << 24) | (c.g << 16) | (c.b << 8) | c.a)
 
-enum { MAX_UNDO_LENGTH = 64 };
+// Default amount of memory in bytes which the undo history of a canvas may occupy.
+enum { DEFAULT_HISTORY_BUDGET = 256 << 20 };
+
+// Side length of the square tiles used by the history system to track modified pixels.
+enum { TILE_SIZE = 64 };
+
+// Upper limit for the side length of a single texture used to display the canvas.
+enum { MAX_TEXTURE_SIZE = 2048 };
 
 typedef struct UndoPoint UndoPoint;
+typedef struct Tile Tile;
+typedef struct Compaction Compaction;
 
 typedef struct {
 	int w;
 	int h;
-	SDL_Texture *texture;
+	SDL_Texture **textures; // [textures_x * textures_y] Grid of textures displaying the canvas.
+	int texture_size; // Side length of the textures. The last row and column may be smaller.
+	int textures_x; // Number of texture columns
+	int textures_y; // Number of texture rows
 	Color *pixels; // [w * h] pixels in RGBA format.
-	Color *pixels_backup; // Used inside the history system. Do not edit directly.
-	UndoPoint *history[MAX_UNDO_LENGTH]; // Circular buffer
-	int next_hist; // Next index inside history
-	int undo_left; // Remaining amount of undo steps (<= MAX_UNDO_LENGTH)
+	int tiles_x; // Number of tile columns
+	int tiles_y; // Number of tile rows
+	Tile *tiles; // [tiles_x * tiles_y] Used inside the history system. Do not edit directly.
+	int *touched; // Indices of all tiles touched since the last commit. Every touched tile keeps
+	              // track of its own dirty region.
+	int ntouched;
+	int *stale; // Indices of all tiles whose pixels have not been uploaded to the texture yet.
+	int nstale;
+	size_t uploaded_bytes; // Amount of pixel data uploaded by the last canvas_flush_texture call.
+	SDL_Rect uploaded_region; // Bounding box of the pixels uploaded by the last flush.
+	UndoPoint **history; // [undo_left + redo_left] Oldest undo point first.
+	int history_cap; // Number of elements allocated for the history array.
+	int undo_left; // Remaining amount of undo steps. history[undo_left - 1] is undone next.
 	int redo_left; // Amount of redo operations left. Every successful undo increments this counter.
-	SDL_Rect dirty; // Difference between pixels and pixels_backup
+	size_t history_bytes; // Amount of memory occupied by all undo points.
+	size_t history_budget; // The oldest undo points are moved to the journal when history_bytes exceeds this.
+	Journal *journal; // Holds undo points that do not fit into the history budget. Created lazily.
+	Compaction *compaction; // Compression in progress inside canvas_compact_history. Can be NULL.
+	int compact_next; // History index from which canvas_compact_history continues its search.
 	char const *filepath; // Can be NULL if this canvas has not been associated with a file yet. Allocated on the heap.
 	bool unsaved;
+	unsigned version; // Incremented whenever the pixels change. Used to detect edits during a save.
 } Canvas;
 
 // Pixels must point to a valid heap-allocated [w * h] array. Canvas becomes
@@ -43,45 +70,38 @@ Canvas canvas_create_from_memory(int w, int h, Color *pixels, SDL_Renderer *ren)
 // Creates a new canvas with bg as its background.
 Canvas canvas_create_with_background(int w, int h, Color bg, SDL_Renderer *ren);
 
-// Tries to create a canvas with the specified image content. Returns NULL on success and an error
-// message on failure. Note that the previous canvas inside 'out_result' is NOT free'd by this
-// function.
-char const *canvas_open_image(Canvas *out_result, char const *filepath, SDL_Renderer *ren);
-
 // Frees the dynamically allocated memory inside the canvas.
 void canvas_free(Canvas c);
 
+// Prepares the given region for modification. This function must be called before writing to any
+// pixels inside the region, so that the history system can remember their previous values. Only
+// tiles that have not been touched since the last commit are copied.
+void canvas_touch(Canvas *canvas, SDL_Rect region);
+
 // Marks the given region as dirty. Marking the same area as dirty multiple times has no effect.
-// Dirty regions will be added to the undolist by the next commit on this canvas. This function
-// will also update the underlying texture buffer.
+// Dirty regions will be added to the undolist by the next commit on this canvas. The region must
+// have been touched with canvas_touch beforehand. The texture is not updated until the next call
+// to canvas_flush_texture.
 void canvas_mark_dirty(Canvas *canvas, SDL_Rect region);
 
 // Adds a new savepoint to the undolist containing all currently dirty regions. Clears the dirty
-// status of all added regions. If the dirty rectangle is empty then no commit is done.
+// status of all added regions. If no region is dirty then no commit is done.
 void canvas_commit(Canvas *canvas);
 
 // Undoes the last fully commited operation. Returns false if no history was left and no undo
-// was performed. This operation will cancel any uncommited changes to the canvas. This function
-// will also update the underlying texture buffer.
+// was performed. This operation will cancel any uncommited changes to the canvas.
 bool canvas_undo(Canvas *canvas);
 
 // Reverts an undo operation. Returns false if no history was left and no redo was performed. This
-// operation will cancel any uncommited changes to the canvas. This function will also update the
-// underlying texture buffer.
+// operation will cancel any uncommited changes to the canvas.
 bool canvas_redo(Canvas *canvas);
 
-typedef enum {
-	CF_OK, // Everything went as planned.
-	CF_CANCELLED_BY_USER, // User has canceled a file chooser dialog.
-	CF_UNKNOWN_IMAGE_FORMAT, // The specified filepath has an unknown image extension.
-	CF_OTHER_ERROR,
-} CanvasFileStatus;
-
-// Tries to save the image data inside the canvas to a file. If filepath is not NULL then this
-// canvas becomes associated with it. Otherwise, the user may be prompted to enter a filepath if
-// this canvas has not yet been associated with a file.
-CanvasFileStatus canvas_save_to_file(Canvas *canvas, char const *filepath);
-
-// This function is similar to canvas_save_to_file, but the user is always prompted to enter a
-// filename.
-CanvasFileStatus canvas_save_as_to_file(Canvas *canvas);
+// Uploads all pixels modified since the last call to the texture. Should be called once per frame
+// before the texture is rendered.
+void canvas_flush_texture(Canvas *canvas);
+
+// Compresses a small part of an undo point which is far away from the current position in the
+// history. Large undo points are compressed over several calls. Returns false if there is nothing
+// left to compress. This function is meant to be called repeatedly while the application is idle. Compressed undo points are transparently
+// decompressed by canvas_undo and canvas_redo.
+bool canvas_compact_history(Canvas *canvas);
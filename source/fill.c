@@ -0,0 +1,557 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL_cpuinfo.h>
+#include <SDL2/SDL_thread.h>
+#include "fill.h"
+#include "kernel.h"
+#include "util.h"
+
+enum {
+	PARALLEL_FILL_PIXELS = 1 << 21, // Smaller canvases are always filled on a single thread.
+	// The parallel fill labels the whole canvas, so it is much slower for small areas on large
+	// canvases (see bench/fill.c). Every fill therefore starts on a single thread and only
+	// switches to the parallel fill once the area exceeds this fraction of the canvas.
+	PARALLEL_FILL_FRACTION = 8,
+	MAX_FILL_THREADS = 16,
+};
+
+// Pixel from which the filling of a new span starts.
+typedef struct {
+	int x;
+	int y;
+} Seed;
+
+typedef struct {
+	Seed *data;
+	int size;
+	int cap;
+} SeedStack;
+
+// Pixels from x0 to x1 (inclusive) in row y which belong to the filled area.
+typedef struct {
+	int y;
+	int x0;
+	int x1;
+} FilledSpan;
+
+static void push_seed(SeedStack *stack, int x, int y)
+{
+	if (stack->size == stack->cap) {
+		stack->cap = MAX(64, stack->cap * 2);
+		stack->data = xrealloc(stack->data, stack->cap * sizeof(Seed));
+	}
+	stack->data[stack->size++] = (Seed) {x, y};
+}
+
+// Values of the selection mask.
+enum {
+	NO_MATCH = 0,
+	SELECTED = 1, // Already part of the filled area.
+	MATCH = 0xff, // Similar to the target color but not reached yet.
+};
+
+// Selection mask of the pixels which are similar to the target color. The mask is computed from
+// the original pixels, so the fill can paint the canvas while it is still searching. Rows are only
+// compared once the fill reaches them.
+typedef struct {
+	Canvas const *canvas;
+	Color target;
+	uint8_t tolerance;
+	uint8_t *mask; // [w * h]
+	bool *ready; // [h] Whether the row of the mask has been computed yet.
+} Selection;
+
+static uint8_t *selection_row(Selection *sel, int y)
+{
+	uint8_t *row = &sel->mask[y * sel->canvas->w];
+	if (!sel->ready[y]) {
+		kernel_match(&sel->canvas->pixels[y * sel->canvas->w], sel->canvas->w, sel->target, sel->tolerance, row);
+		sel->ready[y] = true;
+	}
+	return row;
+}
+
+// Pushes a seed for every run of pixels in row y between from and to (inclusive) which still
+// have to be filled.
+static void scan_row(Selection *sel, SeedStack *stack, int from, int to, int y)
+{
+	uint8_t const *row = selection_row(sel, y);
+	bool span_added = false;
+	for (int x = from; x <= to; ++x) {
+		if (row[x] != MATCH) {
+			span_added = false;
+		} else if (!span_added) {
+			push_seed(stack, x, y);
+			span_added = true;
+		}
+	}
+}
+
+// A span filling algorithm, see https://en.wikipedia.org/wiki/Flood_fill#Span_Filling
+// The seed stack grows as needed, so the fill always completes. Only the filled spans are marked
+// dirty, so undo points and texture uploads do not grow with the bounding box of the area. The
+// canvas is only painted after the whole area has been found. If the area grows larger than budget
+// pixels, the fill gives up without changing the canvas and returns false.
+static bool fill_serial(Canvas *canvas, int x, int y, Color target, uint8_t tolerance, Color color, size_t budget)
+{
+	Selection sel = {
+		.canvas = canvas,
+		.target = target,
+		.tolerance = tolerance,
+		.mask = xalloc(canvas->w * canvas->h),
+		.ready = xalloc(canvas->h * sizeof(bool)),
+	};
+	SeedStack stack = {0};
+	push_seed(&stack, x, y);
+	FilledSpan *spans = NULL;
+	int nspans = 0;
+	int spans_cap = 0;
+	size_t area = 0;
+
+	while (stack.size > 0 && area <= budget) {
+		Seed p = stack.data[--stack.size];
+		uint8_t *row = selection_row(&sel, p.y);
+		if (row[p.x] != MATCH) {
+			// Already filled as part of another span.
+			continue;
+		}
+
+		int from = p.x;
+		while (from > 0 && row[from - 1] == MATCH) {
+			--from;
+		}
+		int to = p.x;
+		while (to + 1 < canvas->w && row[to + 1] == MATCH) {
+			++to;
+		}
+		memset(&row[from], SELECTED, to - from + 1);
+		if (nspans == spans_cap) {
+			spans_cap = MAX(64, spans_cap * 2);
+			spans = xrealloc(spans, spans_cap * sizeof(FilledSpan));
+		}
+		spans[nspans++] = (FilledSpan) {p.y, from, to};
+		area += to - from + 1;
+
+		if (p.y > 0) {
+			scan_row(&sel, &stack, from, to, p.y - 1);
+		}
+		if (p.y + 1 < canvas->h) {
+			scan_row(&sel, &stack, from, to, p.y + 1);
+		}
+	}
+	free(stack.data);
+	free(sel.mask);
+	free(sel.ready);
+
+	bool const complete = area <= budget;
+	for (int i = 0; complete && i < nspans; ++i) {
+		SDL_Rect span = {spans[i].x0, spans[i].y, spans[i].x1 - spans[i].x0 + 1, 1};
+		canvas_touch(canvas, span);
+		kernel_fill(&canvas->pixels[span.y * canvas->w + span.x], span.w, color);
+		canvas_mark_dirty(canvas, span);
+	}
+	free(spans);
+	return complete;
+}
+
+// Run of pixels similar to the target color in a single row.
+typedef struct {
+	int x0;
+	int x1; // Exclusive
+} Span;
+
+// A horizontal band of the canvas which is processed by one thread of the parallel fill.
+typedef struct {
+	Canvas *canvas;
+	Color target;
+	uint8_t tolerance;
+	Color color;
+	int y0;
+	int y1; // Exclusive
+	Span *spans; // All spans of the band, sorted by row and x.
+	int nspans;
+	int spans_cap;
+	int *row_start; // [y1 - y0 + 1] Index of the first span of every row.
+	int *parent; // [nspans] Union-find forest of the spans. Roots have the smallest index.
+	int base; // Index of the first span in the global union-find forest.
+	int *global; // Shared union-find forest of the band-local roots. Stores the parent plus one.
+	int root; // Global root of the spans which have to be filled.
+	bool *fill; // [nspans] Which spans belong to the filled area.
+	SDL_Rect *dirty; // Filled region of every canvas tile in the band, row by row.
+	int ndirty;
+} Band;
+
+static int find(int *parent, int i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+static void unite(int *parent, int a, int b)
+{
+	a = find(parent, a);
+	b = find(parent, b);
+	if (a < b) {
+		parent[b] = a;
+	} else if (b < a) {
+		parent[a] = b;
+	}
+}
+
+// Entries of the global forest are zero for roots, so the array does not have to be initialized.
+static int find_global(int const *global, int i)
+{
+	while (global[i] != 0) {
+		i = global[i] - 1;
+	}
+	return i;
+}
+
+static void unite_global(int *global, int a, int b)
+{
+	a = find_global(global, a);
+	b = find_global(global, b);
+	if (a < b) {
+		global[b] = a + 1;
+	} else if (b < a) {
+		global[a] = b + 1;
+	}
+}
+
+// Returns the height of the bands if the canvas is split into nbands horizontal bands. Bands
+// start at tile borders, so every tile belongs to a single band.
+static int get_band_height(Canvas const *canvas, int nbands)
+{
+	int height = (canvas->h + nbands - 1) / nbands;
+	return (height + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+}
+
+// Calls func for every element of the bands array, each on its own thread. The first band runs on
+// the calling thread.
+static void run_bands(SDL_ThreadFunction func, void *bands, size_t band_size, int nbands)
+{
+	SDL_Thread *threads[MAX_FILL_THREADS] = {0};
+	for (int i = 1; i < nbands; ++i) {
+		void *band = (char *) bands + i * band_size;
+		threads[i] = SDL_CreateThread(func, "fill", band);
+		if (threads[i] == NULL) {
+			func(band);
+		}
+	}
+	func(bands);
+	for (int i = 1; i < nbands; ++i) {
+		if (threads[i] != NULL) {
+			SDL_WaitThread(threads[i], NULL);
+		}
+	}
+}
+
+// Finds all spans similar to the target color in the band and connects the ones which touch
+// each other.
+static int label_band(void *data)
+{
+	Band *band = data;
+	Canvas const *canvas = band->canvas;
+	band->row_start = xalloc((band->y1 - band->y0 + 1) * sizeof(int));
+	uint8_t *match = xalloc(canvas->w);
+	for (int y = band->y0; y < band->y1; ++y) {
+		kernel_match(&canvas->pixels[y * canvas->w], canvas->w, band->target, band->tolerance, match);
+		int prev = y > band->y0 ? band->row_start[y - band->y0 - 1] : 0;
+		int prev_end = band->nspans;
+		band->row_start[y - band->y0] = band->nspans;
+		for (int x = 0; x < canvas->w;) {
+			if (!match[x]) {
+				++x;
+				continue;
+			}
+			Span span = {x, x};
+			while (span.x1 < canvas->w && match[span.x1]) {
+				++span.x1;
+			}
+			x = span.x1;
+
+			if (band->nspans == band->spans_cap) {
+				band->spans_cap = MAX(256, band->spans_cap * 2);
+				band->spans = xrealloc(band->spans, band->spans_cap * sizeof(Span));
+				band->parent = xrealloc(band->parent, band->spans_cap * sizeof(int));
+			}
+			int index = band->nspans++;
+			band->spans[index] = span;
+			band->parent[index] = index;
+
+			// Connect to all overlapping spans in the previous row.
+			while (prev < prev_end && band->spans[prev].x1 <= span.x0) {
+				++prev;
+			}
+			for (int i = prev; i < prev_end && band->spans[i].x0 < span.x1; ++i) {
+				unite(band->parent, index, i);
+			}
+		}
+	}
+	band->row_start[band->y1 - band->y0] = band->nspans;
+	free(match);
+
+	// Point every span directly to its root. Roots always have a smaller index than the spans in
+	// their tree, so they are resolved first.
+	for (int i = 0; i < band->nspans; ++i) {
+		band->parent[i] = band->parent[band->parent[i]];
+	}
+	return 0;
+}
+
+// Decides which spans of the band belong to the filled area and collects their region in every
+// tile.
+static int select_band(void *data)
+{
+	Band *band = data;
+	Canvas const *canvas = band->canvas;
+	band->fill = xalloc(MAX(band->nspans, 1) * sizeof(bool));
+	int tile_y0 = band->y0 / TILE_SIZE;
+	band->ndirty = ((band->y1 + TILE_SIZE - 1) / TILE_SIZE - tile_y0) * canvas->tiles_x;
+	band->dirty = xalloc(MAX(band->ndirty, 1) * sizeof(SDL_Rect));
+	for (int y = band->y0; y < band->y1; ++y) {
+		for (int i = band->row_start[y - band->y0]; i < band->row_start[y - band->y0 + 1]; ++i) {
+			int root = band->parent[i];
+			if (root == i) {
+				band->fill[i] = find_global(band->global, band->base + i) == band->root;
+			} else {
+				band->fill[i] = band->fill[root];
+			}
+			if (!band->fill[i]) {
+				continue;
+			}
+			Span span = band->spans[i];
+			SDL_Rect *row = &band->dirty[(y / TILE_SIZE - tile_y0) * canvas->tiles_x];
+			for (int tx = span.x0 / TILE_SIZE; tx <= (span.x1 - 1) / TILE_SIZE; ++tx) {
+				int x0 = MAX(span.x0, tx * TILE_SIZE);
+				int x1 = MIN(span.x1, (tx + 1) * TILE_SIZE);
+				SDL_Rect rect = {x0, y, x1 - x0, 1};
+				SDL_UnionRect(&row[tx], &rect, &row[tx]);
+			}
+		}
+	}
+	return 0;
+}
+
+static int paint_band(void *data)
+{
+	Band *band = data;
+	Canvas *canvas = band->canvas;
+	for (int y = band->y0; y < band->y1; ++y) {
+		for (int i = band->row_start[y - band->y0]; i < band->row_start[y - band->y0 + 1]; ++i) {
+			if (band->fill[i]) {
+				Span span = band->spans[i];
+				kernel_fill(&canvas->pixels[y * canvas->w + span.x0], span.x1 - span.x0, band->color);
+			}
+		}
+	}
+	return 0;
+}
+
+// Labels the connected areas similar to the target color in horizontal bands on multiple
+// threads. The labels are merged across the band borders with a union-find forest. Afterwards all
+// bands paint their part of the filled area in parallel.
+static void fill_parallel(Canvas *canvas, int x, int y, Color target, uint8_t tolerance, Color color)
+{
+	int nbands = MIN(MAX(SDL_GetCPUCount(), 1), MAX_FILL_THREADS);
+	int band_height = get_band_height(canvas, nbands);
+	Band bands[MAX_FILL_THREADS] = {0};
+	int nspans = 0;
+	for (int i = 0; i < nbands; ++i) {
+		bands[i].canvas = canvas;
+		bands[i].target = target;
+		bands[i].tolerance = tolerance;
+		bands[i].color = color;
+		bands[i].y0 = MIN(i * band_height, canvas->h);
+		bands[i].y1 = MIN((i + 1) * band_height, canvas->h);
+	}
+	run_bands(label_band, bands, sizeof(Band), nbands);
+
+	for (int i = 0; i < nbands; ++i) {
+		bands[i].base = nspans;
+		nspans += bands[i].nspans;
+	}
+	int *global = xalloc(MAX(nspans, 1) * sizeof(int));
+
+	// Connect the areas which touch each other at the band borders.
+	for (int b = 0; b + 1 < nbands; ++b) {
+		Band *top = &bands[b];
+		Band *bottom = &bands[b + 1];
+		if (top->y1 <= top->y0 || bottom->y1 <= bottom->y0) {
+			continue;
+		}
+		int i = top->row_start[top->y1 - top->y0 - 1];
+		int i_end = top->row_start[top->y1 - top->y0];
+		int j = bottom->row_start[0];
+		int j_end = bottom->row_start[1];
+		while (i < i_end && j < j_end) {
+			Span a = top->spans[i];
+			Span c = bottom->spans[j];
+			if (a.x0 < c.x1 && c.x0 < a.x1) {
+				unite_global(global, top->base + top->parent[i], bottom->base + bottom->parent[j]);
+			}
+			if (a.x1 < c.x1) {
+				++i;
+			} else {
+				++j;
+			}
+		}
+	}
+
+	// Find the area which contains the clicked pixel.
+	Band *seed = &bands[y / band_height];
+	int root = -1;
+	for (int i = seed->row_start[y - seed->y0]; i < seed->row_start[y - seed->y0 + 1]; ++i) {
+		if (seed->spans[i].x0 <= x && x < seed->spans[i].x1) {
+			root = find_global(global, seed->base + seed->parent[i]);
+			break;
+		}
+	}
+	assert(root >= 0);
+
+	for (int i = 0; i < nbands; ++i) {
+		bands[i].global = global;
+		bands[i].root = root;
+	}
+	run_bands(select_band, bands, sizeof(Band), nbands);
+
+	// The canvas is not thread-safe, so all tiles are touched up front.
+	for (int i = 0; i < nbands; ++i) {
+		for (int t = 0; t < bands[i].ndirty; ++t) {
+			canvas_touch(canvas, bands[i].dirty[t]);
+		}
+	}
+	run_bands(paint_band, bands, sizeof(Band), nbands);
+	for (int i = 0; i < nbands; ++i) {
+		for (int t = 0; t < bands[i].ndirty; ++t) {
+			canvas_mark_dirty(canvas, bands[i].dirty[t]);
+		}
+	}
+
+	for (int i = 0; i < nbands; ++i) {
+		free(bands[i].spans);
+		free(bands[i].row_start);
+		free(bands[i].parent);
+		free(bands[i].fill);
+		free(bands[i].dirty);
+	}
+	free(global);
+}
+
+void flood_fill(Canvas *canvas, int x, int y, Color color, uint8_t tolerance)
+{
+	if (x < 0 || y < 0 || x >= canvas->w || y >= canvas->h) {
+		return;
+	}
+	Color target = canvas->pixels[y * canvas->w + x];
+	if (target == color && tolerance == 0) {
+		// Fast out, replacing a color by itself has no effect.
+		return;
+	}
+
+	size_t pixels = (size_t) canvas->w * canvas->h;
+	size_t budget = pixels >= PARALLEL_FILL_PIXELS ? pixels / PARALLEL_FILL_FRACTION : SIZE_MAX;
+	if (!fill_serial(canvas, x, y, target, tolerance, color, budget)) {
+		fill_parallel(canvas, x, y, target, tolerance, color);
+	}
+}
+
+// A horizontal band of the canvas for replace_color.
+typedef struct {
+	Canvas *canvas;
+	Color from;
+	Color to;
+	int y0;
+	int y1; // Exclusive
+	SDL_Rect *dirty; // Region of every canvas tile in the band which contains the replaced color.
+	int ndirty;
+} ReplaceBand;
+
+// Finds the pixels which are going to be replaced in every tile of the band.
+static int find_replaced(void *data)
+{
+	ReplaceBand *band = data;
+	Canvas const *canvas = band->canvas;
+	int tile_y0 = band->y0 / TILE_SIZE;
+	band->ndirty = ((band->y1 + TILE_SIZE - 1) / TILE_SIZE - tile_y0) * canvas->tiles_x;
+	band->dirty = xalloc(MAX(band->ndirty, 1) * sizeof(SDL_Rect));
+	uint8_t *match = xalloc(canvas->w);
+	for (int y = band->y0; y < band->y1; ++y) {
+		kernel_match(&canvas->pixels[y * canvas->w], canvas->w, band->from, 0, match);
+		SDL_Rect *row = &band->dirty[(y / TILE_SIZE - tile_y0) * canvas->tiles_x];
+		for (int tx = 0; tx < canvas->tiles_x; ++tx) {
+			int x0 = tx * TILE_SIZE;
+			int x1 = MIN(x0 + TILE_SIZE, canvas->w);
+			uint8_t const *first = memchr(&match[x0], 0xff, x1 - x0);
+			if (first == NULL) {
+				continue;
+			}
+			int last = x1 - 1;
+			while (!match[last]) {
+				--last;
+			}
+			SDL_Rect rect = {first - match, y, last - (first - match) + 1, 1};
+			SDL_UnionRect(&row[tx], &rect, &row[tx]);
+		}
+	}
+	free(match);
+	return 0;
+}
+
+static int replace_band(void *data)
+{
+	ReplaceBand *band = data;
+	Canvas *canvas = band->canvas;
+	for (int i = 0; i < band->ndirty; ++i) {
+		SDL_Rect rect = band->dirty[i];
+		for (int y = rect.y; y < rect.y + rect.h; ++y) {
+			kernel_replace(&canvas->pixels[y * canvas->w + rect.x], rect.w, band->from, band->to);
+		}
+	}
+	return 0;
+}
+
+void replace_color(Canvas *canvas, int x, int y, Color color)
+{
+	if (x < 0 || y < 0 || x >= canvas->w || y >= canvas->h) {
+		return;
+	}
+	Color from = canvas->pixels[y * canvas->w + x];
+	if (from == color) {
+		return;
+	}
+
+	int nbands = 1;
+	if ((size_t) canvas->w * canvas->h >= PARALLEL_FILL_PIXELS) {
+		nbands = MIN(MAX(SDL_GetCPUCount(), 1), MAX_FILL_THREADS);
+	}
+	int band_height = get_band_height(canvas, nbands);
+	ReplaceBand bands[MAX_FILL_THREADS] = {0};
+	for (int i = 0; i < nbands; ++i) {
+		bands[i].canvas = canvas;
+		bands[i].from = from;
+		bands[i].to = color;
+		bands[i].y0 = MIN(i * band_height, canvas->h);
+		bands[i].y1 = MIN((i + 1) * band_height, canvas->h);
+	}
+	run_bands(find_replaced, bands, sizeof(ReplaceBand), nbands);
+
+	// The canvas is not thread-safe, so all tiles are touched up front.
+	for (int i = 0; i < nbands; ++i) {
+		for (int t = 0; t < bands[i].ndirty; ++t) {
+			canvas_touch(canvas, bands[i].dirty[t]);
+		}
+	}
+	run_bands(replace_band, bands, sizeof(ReplaceBand), nbands);
+	for (int i = 0; i < nbands; ++i) {
+		for (int t = 0; t < bands[i].ndirty; ++t) {
+			canvas_mark_dirty(canvas, bands[i].dirty[t]);
+		}
+		free(bands[i].dirty);
+	}
+}
@@ -0,0 +1,13 @@
+// Fill operations of the bucket and color replacement tools.
+#pragma once
+
+#include "canvas.h"
+
+// Replaces the color of the 4-connected area around (x, y) where all pixels are similar to the
+// pixel at (x, y). Two colors are similar if none of their channels differ by more than the
+// tolerance. The changed pixels are touched and marked dirty on the canvas.
+void flood_fill(Canvas *canvas, int x, int y, Color color, uint8_t tolerance);
+
+// Replaces every pixel on the canvas which has the same color as the pixel at (x, y). Unlike
+// flood_fill, the pixels do not have to be connected.
+void replace_color(Canvas *canvas, int x, int y, Color color);
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL_atomic.h>
+#include <SDL2/SDL_endian.h>
+#include <SDL2/SDL_events.h>
+#include <SDL2/SDL_thread.h>
+#include "imageio.h"
+#include "kernel.h"
+#include "util.h"
+
+// Define these here to not include the huge header file.
+typedef unsigned char stbi_uc;
+typedef struct {
+	int (*read)(void *user, char *data, int size);
+	void (*skip)(void *user, int n);
+	int (*eof)(void *user);
+} stbi_io_callbacks;
+stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+const char *stbi_failure_reason(void);
+int stbi_write_png(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
+int stbi_write_bmp(char const *filename, int w, int h, int comp, const void *data);
+int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
+// TODO: Implement my own functions to read and write PPM files. This image format is not properly
+// supported by stbi, but I find it useful because of its simplicity.
+
+struct ImageLoader {
+	char *filepath;
+	Uint32 event_type;
+	SDL_Thread *thread;
+	FILE *file;
+	long file_size;
+	long bytes_read;
+	SDL_atomic_t progress; // Permille of the file which has been read.
+	SDL_atomic_t cancelled;
+	// The following fields are written by the worker thread and may only be read after it has
+	// finished.
+	Color *pixels;
+	int w;
+	int h;
+	char const *error; // Static string. NULL on success.
+};
+
+typedef enum { FORMAT_PNG, FORMAT_BMP, FORMAT_TGA, FORMAT_UNKNOWN } ImageFormat;
+
+struct ImageSaver {
+	char *filepath;
+	ImageFormat format;
+	Uint32 event_type;
+	SDL_Thread *thread;
+	uint8_t *rgba; // [w * h * 4] Snapshot of the canvas in the byte order expected by stbi.
+	int w;
+	int h;
+	unsigned version; // Version of the canvas when the snapshot was taken.
+	bool success; // Written by the worker thread.
+};
+
+Uint32 image_event_type(void)
+{
+	static Uint32 type = (Uint32) -1;
+	if (type == (Uint32) -1) {
+		type = SDL_RegisterEvents(1);
+		if (type == (Uint32) -1) {
+			fatalSDL("Could not register event");
+		}
+	}
+	return type;
+}
+
+static int read_file(void *user, char *data, int size)
+{
+	ImageLoader *loader = user;
+	if (SDL_AtomicGet(&loader->cancelled)) {
+		return 0;
+	}
+	int n = (int) fread(data, 1, size, loader->file);
+	loader->bytes_read += n;
+	if (loader->file_size > 0) {
+		SDL_AtomicSet(&loader->progress, (int) (MIN(loader->bytes_read, loader->file_size) * 1000 / loader->file_size));
+	}
+	return n;
+}
+
+static void skip_file(void *user, int n)
+{
+	ImageLoader *loader = user;
+	fseek(loader->file, n, SEEK_CUR);
+	loader->bytes_read += n;
+}
+
+static int file_eof(void *user)
+{
+	ImageLoader *loader = user;
+	return SDL_AtomicGet(&loader->cancelled) || feof(loader->file);
+}
+
+static char const *decode_image(ImageLoader *loader)
+{
+	loader->file = fopen(loader->filepath, "rb");
+	if (loader->file == NULL) {
+		return "Unable to open file";
+	}
+	if (fseek(loader->file, 0, SEEK_END) == 0) {
+		loader->file_size = ftell(loader->file);
+	}
+	rewind(loader->file);
+
+	stbi_io_callbacks const callbacks = {read_file, skip_file, file_eof};
+	Color *rgba = (Color *) stbi_load_from_callbacks(&callbacks, loader, &loader->w, &loader->h, NULL, 4);
+	fclose(loader->file);
+	if (SDL_AtomicGet(&loader->cancelled)) {
+		free(rgba);
+		return "Cancelled";
+	}
+	if (rgba == NULL) {
+		return stbi_failure_reason(); // The failure reason is stored per thread.
+	}
+	if (loader->w == 0 || loader->h == 0) {
+		// No idea if this can actually happen :/
+		free(rgba);
+		return "Empty image";
+	}
+
+	// Convert endianness
+	for (int i = 0; i < loader->w * loader->h; ++i) {
+		rgba[i] = SDL_SwapBE32(rgba[i]);
+	}
+	loader->pixels = rgba;
+	return NULL;
+}
+
+static int load_thread(void *data)
+{
+	ImageLoader *loader = data;
+	loader->error = decode_image(loader);
+	SDL_AtomicSet(&loader->progress, 1000);
+
+	SDL_Event e = {0};
+	e.type = loader->event_type;
+	e.user.code = IMAGE_LOADED;
+	e.user.data1 = loader;
+	SDL_PushEvent(&e);
+	return 0;
+}
+
+ImageLoader *image_load_async(char const *filepath)
+{
+	ImageLoader *loader = xalloc(sizeof(*loader));
+	loader->filepath = xstrdup(filepath);
+	loader->event_type = image_event_type();
+	loader->thread = SDL_CreateThread(load_thread, "image loader", loader);
+	if (loader->thread == NULL) {
+		// Load the image synchronously instead. The event is handled like any other.
+		load_thread(loader);
+	}
+	return loader;
+}
+
+float image_load_progress(ImageLoader const *loader)
+{
+	return SDL_AtomicGet((SDL_atomic_t *) &loader->progress) / 1000.0f;
+}
+
+void image_load_cancel(ImageLoader *loader)
+{
+	SDL_AtomicSet(&loader->cancelled, 1);
+}
+
+bool image_load_cancelled(ImageLoader const *loader)
+{
+	return SDL_AtomicGet((SDL_atomic_t *) &loader->cancelled);
+}
+
+char const *image_load_finish(ImageLoader *loader, Canvas *out_result, SDL_Renderer *ren)
+{
+	memset(out_result, 0, sizeof(*out_result));
+	if (loader->thread != NULL) {
+		SDL_WaitThread(loader->thread, NULL);
+	}
+	char const *error = loader->error;
+	if (error == NULL) {
+		*out_result = canvas_create_from_memory(loader->w, loader->h, loader->pixels, ren);
+		out_result->filepath = loader->filepath;
+	} else {
+		free(loader->filepath);
+	}
+	free(loader);
+	return error;
+}
+
+void image_load_discard(ImageLoader *loader)
+{
+	if (loader == NULL) {
+		return;
+	}
+	image_load_cancel(loader);
+	if (loader->thread != NULL) {
+		SDL_WaitThread(loader->thread, NULL);
+	}
+	free(loader->pixels);
+	free(loader->filepath);
+	free(loader);
+}
+
+static ImageFormat get_format(char const *filepath)
+{
+	char const *ext = strrchr(filepath, '.');
+	if (ext == NULL || strcmp(ext, ".png") == 0) {
+		return FORMAT_PNG;
+	} else if (strcmp(ext, ".bmp") == 0 || strcmp(ext, ".dib") == 0) {
+		return FORMAT_BMP;
+	} else if (strcmp(ext, ".tga") == 0) {
+		return FORMAT_TGA;
+	}
+	return FORMAT_UNKNOWN;
+}
+
+static int save_thread(void *data)
+{
+	ImageSaver *saver = data;
+	int const comp = 4; // RGBA
+	switch (saver->format) {
+	case FORMAT_PNG:
+		saver->success = stbi_write_png(saver->filepath, saver->w, saver->h, comp, saver->rgba, 0);
+		break;
+	case FORMAT_BMP:
+		saver->success = stbi_write_bmp(saver->filepath, saver->w, saver->h, comp, saver->rgba);
+		break;
+	case FORMAT_TGA:
+		saver->success = stbi_write_tga(saver->filepath, saver->w, saver->h, comp, saver->rgba);
+		break;
+	case FORMAT_UNKNOWN:
+		unreachable();
+	}
+
+	SDL_Event e = {0};
+	e.type = saver->event_type;
+	e.user.code = IMAGE_SAVED;
+	e.user.data1 = saver;
+	SDL_PushEvent(&e);
+	return 0;
+}
+
+ImageSaver *image_save_async(Canvas const *canvas, char const *filepath)
+{
+	ImageFormat format = get_format(filepath);
+	if (format == FORMAT_UNKNOWN) {
+		return NULL;
+	}
+	ImageSaver *saver = xalloc(sizeof(*saver));
+	saver->filepath = xstrdup(filepath);
+	saver->format = format;
+	saver->event_type = image_event_type();
+	// The pixels are converted while they are copied, so the encoder can use the snapshot as is.
+	saver->rgba = xalloc(canvas->w * canvas->h * sizeof(Color));
+	kernel_to_rgba(saver->rgba, canvas->pixels, canvas->w * canvas->h);
+	saver->w = canvas->w;
+	saver->h = canvas->h;
+	saver->version = canvas->version;
+	saver->thread = SDL_CreateThread(save_thread, "image saver", saver);
+	if (saver->thread == NULL) {
+		save_thread(saver);
+	}
+	return saver;
+}
+
+bool image_save_finish(ImageSaver *saver, Canvas *canvas)
+{
+	if (saver->thread != NULL) {
+		SDL_WaitThread(saver->thread, NULL);
+	}
+	bool success = saver->success;
+	if (success && canvas != NULL) {
+		free((char *) canvas->filepath);
+		canvas->filepath = saver->filepath;
+		saver->filepath = NULL;
+		if (canvas->version == saver->version) {
+			canvas->unsaved = false;
+		}
+	}
+	free(saver->filepath);
+	free(saver->rgba);
+	free(saver);
+	return success;
+}
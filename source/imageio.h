@@ -0,0 +1,52 @@
+// Loads and saves images on worker threads, so that large files do not freeze the user interface.
+// The main thread is notified through an SDL user event once a worker has finished.
+#pragma once
+
+#include <SDL2/SDL_render.h>
+#include <stdbool.h>
+#include "canvas.h"
+
+typedef struct ImageLoader ImageLoader;
+typedef struct ImageSaver ImageSaver;
+
+// Values of the code field of image events.
+enum {
+	IMAGE_LOADED,
+	IMAGE_SAVED,
+};
+
+// Returns the type of the user event which is pushed when a worker thread has finished. Must be
+// called on the main thread.
+Uint32 image_event_type(void);
+
+// Starts decoding the image at filepath on a worker thread. A completion event is always pushed,
+// even if the image could not be loaded.
+ImageLoader *image_load_async(char const *filepath);
+
+// Returns the fraction of the file which has been read so far, in the range [0, 1].
+float image_load_progress(ImageLoader const *loader);
+
+// Asks the worker thread to stop reading the file. The completion event is pushed nonetheless,
+// and image_load_finish has to be called as usual.
+void image_load_cancel(ImageLoader *loader);
+
+// Returns true if image_load_cancel has been called on the loader.
+bool image_load_cancelled(ImageLoader const *loader);
+
+// Waits for the worker thread and creates a canvas from the decoded image. Returns NULL on success
+// and an error message on failure. The loader is freed in both cases. Note that the previous
+// canvas inside 'out_result' is NOT free'd by this function.
+char const *image_load_finish(ImageLoader *loader, Canvas *out_result, SDL_Renderer *ren);
+
+// Cancels the loader, waits for the worker thread and frees everything. Accepts NULL.
+void image_load_discard(ImageLoader *loader);
+
+// Takes a snapshot of the canvas pixels and writes it to filepath on a worker thread, so the
+// canvas can be edited during the save. The format is chosen by the file extension. Returns NULL
+// if the format is not supported.
+ImageSaver *image_save_async(Canvas const *canvas, char const *filepath);
+
+// Waits for the worker thread and frees the saver. Returns true if the image has been written. On
+// success, the canvas becomes associated with the file and is marked as saved, unless it has been
+// edited since the snapshot was taken. Canvas may be NULL if it no longer exists.
+bool image_save_finish(ImageSaver *saver, Canvas *canvas);
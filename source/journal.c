@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "util.h"
+
+// Range of released bytes inside the journal file.
+typedef struct {
+	size_t offset;
+	size_t size;
+} Range;
+
+struct Journal {
+	int fd;
+	size_t size; // Length of the file in bytes
+	size_t live; // Number of bytes which have not been released yet
+	Range *free; // Released ranges sorted by offset. Adjacent ranges are always merged.
+	int nfree;
+	int free_cap;
+	unsigned char *map; // Mapping of the first 'mapped' bytes of the file. Can be NULL.
+	size_t mapped;
+};
+
+// Writes the path of the cache directory into buf and creates it if necessary. Returns false if
+// the directory could not be created.
+static bool cache_directory(char *buf, size_t n)
+{
+	char const *xdg = getenv("XDG_CACHE_HOME");
+	char const *home = getenv("HOME");
+	if (xdg != NULL && xdg[0] == '/') {
+		snprintf(buf, n, "%s", xdg);
+	} else if (home != NULL) {
+		snprintf(buf, n, "%s/.cache", home);
+	} else {
+		return false;
+	}
+	if (mkdir(buf, 0700) != 0 && errno != EEXIST) {
+		return false;
+	}
+	size_t len = strlen(buf);
+	snprintf(buf + len, n - len, "/pixelfish");
+	return mkdir(buf, 0700) == 0 || errno == EEXIST;
+}
+
+Journal *journal_open(void)
+{
+	char path[4096];
+	if (!cache_directory(path, sizeof(path) - 32)) {
+		return NULL;
+	}
+	strcat(path, "/undo-XXXXXX");
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	// The file stays accessible through fd until it is closed.
+	unlink(path);
+
+	Journal *j = xalloc(sizeof(Journal));
+	j->fd = fd;
+	return j;
+}
+
+size_t journal_size(Journal const *j)
+{
+	return j->live;
+}
+
+// Writes n bytes to the file at the given offset. Returns false on error.
+static bool write_at(Journal *j, void const *data, size_t n, size_t offset)
+{
+	size_t written = 0;
+	while (written < n) {
+		ssize_t res = pwrite(j->fd, (char const *) data + written, n - written, offset + written);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return false;
+		}
+		written += res;
+	}
+	return true;
+}
+
+bool journal_write(Journal *j, void const *data, size_t n, size_t *out_offset)
+{
+	for (int i = 0; i < j->nfree; ++i) {
+		Range *r = &j->free[i];
+		if (r->size < n) {
+			continue;
+		}
+		if (!write_at(j, data, n, r->offset)) {
+			// The range keeps its garbage and remains released.
+			return false;
+		}
+		*out_offset = r->offset;
+		r->offset += n;
+		r->size -= n;
+		if (r->size == 0) {
+			memmove(r, r + 1, (j->nfree - i - 1) * sizeof(Range));
+			--j->nfree;
+		}
+		j->live += n;
+		return true;
+	}
+
+	if (!write_at(j, data, n, j->size)) {
+		// Drop the partially written data.
+		if (ftruncate(j->fd, j->size) != 0) {
+			// Not a problem, the garbage will be overwritten by the next write.
+		}
+		return false;
+	}
+	*out_offset = j->size;
+	j->size += n;
+	j->live += n;
+	return true;
+}
+
+static void unmap(Journal *j)
+{
+	if (j->map != NULL) {
+		munmap(j->map, j->mapped);
+		j->map = NULL;
+		j->mapped = 0;
+	}
+}
+
+void journal_read(Journal *j, size_t offset, size_t n, void *dest)
+{
+	assert(offset + n <= j->size);
+	if (n == 0) {
+		return;
+	}
+	if (offset + n > j->mapped) {
+		// The file has grown since the last read.
+		unmap(j);
+		void *map = mmap(NULL, j->size, PROT_READ, MAP_SHARED, j->fd, 0);
+		if (map == MAP_FAILED) {
+			fatal("Could not map the undo journal: %s", strerror(errno));
+		}
+		j->map = map;
+		j->mapped = j->size;
+	}
+	memcpy(dest, j->map + offset, n);
+}
+
+void journal_release(Journal *j, size_t offset, size_t n)
+{
+	assert(n <= j->live && offset + n <= j->size);
+	j->live -= n;
+	if (n == 0) {
+		return;
+	}
+
+	int i = 0;
+	while (i < j->nfree && j->free[i].offset < offset) {
+		++i;
+	}
+	bool merge_prev = i > 0 && j->free[i - 1].offset + j->free[i - 1].size == offset;
+	bool merge_next = i < j->nfree && offset + n == j->free[i].offset;
+	if (merge_prev && merge_next) {
+		j->free[i - 1].size += n + j->free[i].size;
+		memmove(&j->free[i], &j->free[i + 1], (j->nfree - i - 1) * sizeof(Range));
+		--j->nfree;
+	} else if (merge_prev) {
+		j->free[i - 1].size += n;
+	} else if (merge_next) {
+		j->free[i].offset = offset;
+		j->free[i].size += n;
+	} else {
+		if (j->nfree == j->free_cap) {
+			j->free_cap = MAX(16, j->free_cap * 2);
+			j->free = xrealloc(j->free, j->free_cap * sizeof(Range));
+		}
+		memmove(&j->free[i + 1], &j->free[i], (j->nfree - i) * sizeof(Range));
+		j->free[i] = (Range) {offset, n};
+		++j->nfree;
+	}
+
+	// Give released space at the end of the file back to the file system.
+	Range last = j->free[j->nfree - 1];
+	if (last.offset + last.size == j->size) {
+		unmap(j);
+		if (ftruncate(j->fd, last.offset) == 0) {
+			j->size = last.offset;
+			--j->nfree;
+		}
+	}
+}
+
+void journal_close(Journal *j)
+{
+	if (j != NULL) {
+		unmap(j);
+		close(j->fd);
+		free(j->free);
+		free(j);
+	}
+}
@@ -0,0 +1,32 @@
+// Journal is a temporary file used to move data out of memory. The file is created
+// inside the user's cache directory and deleted immediately, so it disappears together with the
+// process. Data is read back through a memory mapping of the file. Released ranges are kept in a
+// free list and reused by later writes, so the file does not grow with every spill.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Journal Journal;
+
+// Creates a new empty journal. Returns NULL if the file could not be created.
+Journal *journal_open(void);
+
+// Returns the number of bytes written to the journal which have not been released yet. Released
+// space inside the file is not included.
+size_t journal_size(Journal const *j);
+
+// Writes n bytes into the first released range large enough to hold them, or to the end of the
+// file if there is none, and stores their position in out_offset. Returns false if the data could
+// not be written, in which case the journal remains unchanged.
+bool journal_write(Journal *j, void const *data, size_t n, size_t *out_offset);
+
+// Copies n bytes starting at offset into dest. The data must have been written before.
+void journal_read(Journal *j, size_t offset, size_t n, void *dest);
+
+// Informs the journal that the n bytes written at offset are no longer needed. Their space will
+// be reused by later writes. Released space at the end of the file is truncated.
+void journal_release(Journal *j, size_t offset, size_t n);
+
+// Closes and deletes the journal. Accepts NULL.
+void journal_close(Journal *j);
@@ -0,0 +1,222 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*FillKernel)(uint32_t *dest, int n, uint32_t value);
+typedef void (*MatchKernel)(uint32_t const *src, int n, uint32_t target, uint8_t tolerance, uint8_t *mask);
+typedef void (*ReplaceKernel)(uint32_t *pixels, int n, uint32_t from, uint32_t to);
+typedef void (*ToRgbaKernel)(uint8_t *dest, uint32_t const *src, int n);
+
+static void fill_scalar(uint32_t *dest, int n, uint32_t value)
+{
+	for (int i = 0; i < n; ++i) {
+		dest[i] = value;
+	}
+}
+
+static void match_scalar(uint32_t const *src, int n, uint32_t target, uint8_t tolerance, uint8_t *mask)
+{
+	for (int i = 0; i < n; ++i) {
+		bool match = true;
+		for (int shift = 0; shift < 32; shift += 8) {
+			int a = (src[i] >> shift) & 0xff;
+			int b = (target >> shift) & 0xff;
+			match = match && abs(a - b) <= tolerance;
+		}
+		mask[i] = match ? 0xff : 0;
+	}
+}
+
+static void replace_scalar(uint32_t *pixels, int n, uint32_t from, uint32_t to)
+{
+	for (int i = 0; i < n; ++i) {
+		if (pixels[i] == from) {
+			pixels[i] = to;
+		}
+	}
+}
+
+static void to_rgba_scalar(uint8_t *dest, uint32_t const *src, int n)
+{
+	for (int i = 0; i < n; ++i) {
+		dest[4 * i + 0] = src[i] >> 24;
+		dest[4 * i + 1] = (src[i] >> 16) & 0xff;
+		dest[4 * i + 2] = (src[i] >> 8) & 0xff;
+		dest[4 * i + 3] = src[i] & 0xff;
+	}
+}
+
+#ifdef KERNEL_X86
+// Returns -1 in every 32-bit lane where all channels are within the tolerance.
+__attribute__ ((target("sse2")))
+static __m128i match4_sse2(uint32_t const *src, __m128i target, __m128i tolerance)
+{
+	__m128i v = _mm_loadu_si128((__m128i const *) src);
+	__m128i diff = _mm_or_si128(_mm_subs_epu8(v, target), _mm_subs_epu8(target, v));
+	return _mm_cmpeq_epi32(_mm_subs_epu8(diff, tolerance), _mm_setzero_si128());
+}
+
+__attribute__ ((target("sse2")))
+static void match_sse2(uint32_t const *src, int n, uint32_t target, uint8_t tolerance, uint8_t *mask)
+{
+	__m128i t = _mm_set1_epi32((int) target);
+	__m128i tol = _mm_set1_epi8((char) tolerance);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i m0 = match4_sse2(&src[i], t, tol);
+		__m128i m1 = match4_sse2(&src[i + 4], t, tol);
+		__m128i m2 = match4_sse2(&src[i + 8], t, tol);
+		__m128i m3 = match4_sse2(&src[i + 12], t, tol);
+		// Saturating packs turn the 32-bit masks into bytes without changing their order.
+		__m128i bytes = _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_packs_epi32(m2, m3));
+		_mm_storeu_si128((__m128i *) &mask[i], bytes);
+	}
+	match_scalar(&src[i], n - i, target, tolerance, &mask[i]);
+}
+
+__attribute__ ((target("sse2")))
+static void replace_sse2(uint32_t *pixels, int n, uint32_t from, uint32_t to)
+{
+	__m128i f = _mm_set1_epi32((int) from);
+	__m128i t = _mm_set1_epi32((int) to);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((__m128i const *) &pixels[i]);
+		__m128i eq = _mm_cmpeq_epi32(v, f);
+		v = _mm_or_si128(_mm_and_si128(eq, t), _mm_andnot_si128(eq, v));
+		_mm_storeu_si128((__m128i *) &pixels[i], v);
+	}
+	replace_scalar(&pixels[i], n - i, from, to);
+}
+
+// x86 is little-endian, so reversing the bytes of every pixel yields the RGBA byte order.
+__attribute__ ((target("sse2")))
+static void to_rgba_sse2(uint8_t *dest, uint32_t const *src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((__m128i const *) &src[i]);
+		// SSE2 has no byte shuffle. Swap the 16-bit halves of each pixel, then the bytes of each half.
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) &dest[4 * i], v);
+	}
+	to_rgba_scalar(&dest[4 * i], &src[i], n - i);
+}
+
+__attribute__ ((target("avx2")))
+static __m256i match8_avx2(uint32_t const *src, __m256i target, __m256i tolerance)
+{
+	__m256i v = _mm256_loadu_si256((__m256i const *) src);
+	__m256i diff = _mm256_or_si256(_mm256_subs_epu8(v, target), _mm256_subs_epu8(target, v));
+	return _mm256_cmpeq_epi32(_mm256_subs_epu8(diff, tolerance), _mm256_setzero_si256());
+}
+
+__attribute__ ((target("avx2")))
+static void match_avx2(uint32_t const *src, int n, uint32_t target, uint8_t tolerance, uint8_t *mask)
+{
+	__m256i t = _mm256_set1_epi32((int) target);
+	__m256i tol = _mm256_set1_epi8((char) tolerance);
+	// The packs work within 128-bit lanes, which leaves groups of four pixels interleaved.
+	__m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i m0 = match8_avx2(&src[i], t, tol);
+		__m256i m1 = match8_avx2(&src[i + 8], t, tol);
+		__m256i m2 = match8_avx2(&src[i + 16], t, tol);
+		__m256i m3 = match8_avx2(&src[i + 24], t, tol);
+		__m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(m0, m1), _mm256_packs_epi32(m2, m3));
+		_mm256_storeu_si256((__m256i *) &mask[i], _mm256_permutevar8x32_epi32(bytes, order));
+	}
+	match_scalar(&src[i], n - i, target, tolerance, &mask[i]);
+}
+
+__attribute__ ((target("avx2")))
+static void replace_avx2(uint32_t *pixels, int n, uint32_t from, uint32_t to)
+{
+	__m256i f = _mm256_set1_epi32((int) from);
+	__m256i t = _mm256_set1_epi32((int) to);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((__m256i const *) &pixels[i]);
+		__m256i eq = _mm256_cmpeq_epi32(v, f);
+		_mm256_storeu_si256((__m256i *) &pixels[i], _mm256_blendv_epi8(v, t, eq));
+	}
+	replace_scalar(&pixels[i], n - i, from, to);
+}
+
+__attribute__ ((target("avx2")))
+static void to_rgba_avx2(uint8_t *dest, uint32_t const *src, int n)
+{
+	__m256i reverse = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((__m256i const *) &src[i]);
+		_mm256_storeu_si256((__m256i *) &dest[4 * i], _mm256_shuffle_epi8(v, reverse));
+	}
+	to_rgba_scalar(&dest[4 * i], &src[i], n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void fill_avx2(uint32_t *dest, int n, uint32_t value)
+{
+	__m256i v = _mm256_set1_epi32((int) value);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i *) &dest[i], v);
+	}
+	for (; i < n; ++i) {
+		dest[i] = value;
+	}
+}
+#endif
+
+static FillKernel fill_kernel = fill_scalar;
+static MatchKernel match_kernel = match_scalar;
+static ReplaceKernel replace_kernel = replace_scalar;
+static ToRgbaKernel to_rgba_kernel = to_rgba_scalar;
+
+void kernel_init(void)
+{
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fill_kernel = fill_avx2;
+		match_kernel = match_avx2;
+		replace_kernel = replace_avx2;
+		to_rgba_kernel = to_rgba_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		// fill_scalar is already vectorized with SSE2 by the compiler.
+		match_kernel = match_sse2;
+		replace_kernel = replace_sse2;
+		to_rgba_kernel = to_rgba_sse2;
+	}
+#endif
+}
+
+void kernel_fill(uint32_t *dest, int n, uint32_t value)
+{
+	fill_kernel(dest, n, value);
+}
+
+void kernel_match(uint32_t const *src, int n, uint32_t target, uint8_t tolerance, uint8_t *mask)
+{
+	match_kernel(src, n, target, tolerance, mask);
+}
+
+void kernel_replace(uint32_t *pixels, int n, uint32_t from, uint32_t to)
+{
+	replace_kernel(pixels, n, from, to);
+}
+
+void kernel_to_rgba(uint8_t *dest, uint32_t const *src, int n)
+{
+	to_rgba_kernel(dest, src, n);
+}
@@ -0,0 +1,23 @@
+// Vectorized loops over rows of 32-bit pixels. Every kernel has a portable scalar version and
+// SSE2/AVX2 versions which are selected at runtime depending on what the CPU supports. Versions
+// which are not faster than the scalar one in bench/kernel.c are left out.
+#pragma once
+
+#include <stdint.h>
+
+// Selects the fastest kernels for the current CPU. Until this is called, the scalar versions are
+// used.
+void kernel_init(void);
+
+// Sets n pixels starting at dest to the given value.
+void kernel_fill(uint32_t *dest, int n, uint32_t value);
+
+// Sets mask[i] to 0xff if no channel of src[i] differs from the same channel of target by more
+// than tolerance, and to zero otherwise.
+void kernel_match(uint32_t const *src, int n, uint32_t target, uint8_t tolerance, uint8_t *mask);
+
+// Replaces every pixel equal to from with to.
+void kernel_replace(uint32_t *pixels, int n, uint32_t from, uint32_t to);
+
+// Stores n pixels as bytes in R, G, B, A order, independent of the endianness of the machine.
+void kernel_to_rgba(uint8_t *dest, uint32_t const *src, int n);
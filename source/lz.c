@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+// Every sequence starts with a token byte. The upper four bits hold the number of literals, the
+// lower four bits the match length minus MIN_MATCH. Lengths that do not fit into four bits are
+// continued in the following bytes, each one adding up to 255. The literals are followed by a
+// two-byte little-endian offset of the match. The last sequence has no match and ends the data.
+enum {
+	MIN_MATCH = 4,
+	MAX_OFFSET = 0xffff,
+};
+
+size_t lz_bound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+static uint32_t read32(unsigned char const *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *put_literals(unsigned char *op, unsigned char const *lit, size_t n, int match_bits)
+{
+	*op++ = (n < 15 ? n : 15) << 4 | match_bits;
+	if (n >= 15) {
+		op = put_length(op, n - 15);
+	}
+	memcpy(op, lit, n);
+	return op + n;
+}
+
+void lz_stream_init(LzStream *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+bool lz_compress_step(LzStream *s, unsigned char const *src, size_t n, unsigned char *dest, size_t step)
+{
+	if (s->done) {
+		return true;
+	}
+	uint32_t *table = s->table;
+	unsigned char *op = dest + s->out_size;
+	size_t anchor = s->anchor;
+	size_t ip = s->ip;
+	size_t stop = step < n - ip ? ip + step : n;
+	while (ip + MIN_MATCH <= n && ip < stop) {
+		uint32_t seq = read32(src + ip);
+		uint32_t h = hash(seq);
+		size_t candidate = table[h];
+		table[h] = ip;
+		if (candidate >= ip || ip - candidate > MAX_OFFSET || read32(src + candidate) != seq) {
+			// Skip faster through incompressible data.
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		size_t len = MIN_MATCH;
+		while (ip + len < n && src[candidate + len] == src[ip + len]) {
+			++len;
+		}
+		size_t m = len - MIN_MATCH;
+		op = put_literals(op, src + anchor, ip - anchor, m < 15 ? m : 15);
+		size_t offset = ip - candidate;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		if (m >= 15) {
+			op = put_length(op, m - 15);
+		}
+		ip += len;
+		anchor = ip;
+	}
+	if (ip + MIN_MATCH > n) {
+		op = put_literals(op, src + anchor, n - anchor, 0);
+		s->done = true;
+	}
+	s->anchor = anchor;
+	s->ip = ip;
+	s->out_size = op - dest;
+	return s->done;
+}
+
+size_t lz_compress(unsigned char const *src, size_t n, unsigned char *dest)
+{
+	LzStream s;
+	lz_stream_init(&s);
+	lz_compress_step(&s, src, n, dest, n);
+	return s.out_size;
+}
+
+static size_t get_length(unsigned char const **ip, size_t len)
+{
+	if (len == 15) {
+		unsigned char byte;
+		do {
+			byte = *(*ip)++;
+			len += byte;
+		} while (byte == 255);
+	}
+	return len;
+}
+
+void lz_decompress(unsigned char const *src, size_t src_size, unsigned char *dest)
+{
+	unsigned char const *ip = src;
+	unsigned char const *end = src + src_size;
+	unsigned char *op = dest;
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t nlit = get_length(&ip, token >> 4);
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip >= end) {
+			break;
+		}
+
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		size_t len = get_length(&ip, token & 15) + MIN_MATCH;
+		unsigned char const *match = op - offset;
+		// Matches may overlap with the output, so copy byte by byte.
+		for (size_t i = 0; i < len; ++i) {
+			op[i] = match[i];
+		}
+		op += len;
+	}
+}
@@ -0,0 +1,38 @@
+// A small LZ77 compressor used to reduce the memory footprint of rarely accessed data, such as
+// old undo points. The format is similar to LZ4 but is not compatible with it.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum { LZ_HASH_BITS = 12 };
+
+// State of a compression which is split into several steps with lz_compress_step. The output is
+// identical to a single lz_compress call.
+typedef struct {
+	uint32_t table[1 << LZ_HASH_BITS]; // Last input position of every hashed four-byte sequence.
+	size_t anchor; // Start of the literals which have not been written yet.
+	size_t ip; // Current input position.
+	size_t out_size; // Number of bytes written to dest so far.
+	bool done;
+} LzStream;
+
+// Returns the maximum number of bytes lz_compress can produce for an input of size n.
+size_t lz_bound(size_t n);
+
+// Compresses n bytes from src into dest, which must hold at least lz_bound(n) bytes. Returns the
+// size of the compressed data.
+size_t lz_compress(unsigned char const *src, size_t n, unsigned char *dest);
+
+// Prepares the stream for a new compression.
+void lz_stream_init(LzStream *s);
+
+// Continues the compression of n bytes from src into dest, processing roughly step more input
+// bytes. Src, n and dest must be the same in every call. Returns true once the compression has
+// finished, in which case s->out_size holds the size of the compressed data.
+bool lz_compress_step(LzStream *s, unsigned char const *src, size_t n, unsigned char *dest, size_t step);
+
+// Decompresses src_size bytes of data produced by lz_compress. Dest must be large enough to hold
+// the original uncompressed data.
+void lz_decompress(unsigned char const *src, size_t src_size, unsigned char *dest);
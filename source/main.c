@@ -12,6 +12,10 @@
 #include "brush.h"
 #include "dialog.h"
 #include "embed.h"
+#include "text.h"
+#include "kernel.h"
+#include "fill.h"
+#include "imageio.h"
 
 typedef struct {
 	SDL_Color bg;
@@ -29,6 +33,7 @@ typedef enum {
 	ERASER,
 	COLOR_PICKER,
 	BUCKET_FILL,
+	REPLACE_COLOR,
 	TOOL_COUNT // Must be the last element.
 } ToolEnum;
 
@@ -36,12 +41,18 @@ bool running = true;
 SDL_Window *win;
 SDL_Renderer *ren;
 TTF_Font *font;
+GlyphAtlas *glyphs;
 Color left_color;
 Color right_color;
 ToolEnum prev_tool = BRUSH_ROUND;
 ToolEnum tool = BRUSH_ROUND;
 Canvas canvas;
+ImageLoader *image_loader; // Not NULL while an image is being opened.
+ImageSaver *image_saver; // Not NULL while an image is being saved.
+bool save_detached; // The canvas has been replaced while it was being saved.
+size_t history_budget = DEFAULT_HISTORY_BUDGET; // Applied to every new canvas.
 Brush brush;
+int fill_tolerance; // In percent. Zero only fills pixels with exactly the same color.
 SDL_Texture *checkerboard;
 SDL_Point offset;
 float zoom = 15.0f; // One image pixel takes up "zoom" pixels on the screen.
@@ -50,9 +61,34 @@ bool drawing;
 int active_button; // Mouse button used for drawing.
 bool ui_wants_mouse; // Do not pass click-events to the canvas.
 SDL_Point mouse_pos;
-bool just_clicked[6];
+bool stroking; // A brush stroke is in progress.
+SDL_Point stroke_pos; // Position of the last brush stamp in the current stroke.
+Brush stroke_brush; // Size and shape of the brush when the stroke was started.
 char error_text[128]; // Error message displayed in the bottom-left corner.
 Uint64 error_timeout; // Timestamp after which the error_text should disappear.
+bool partial_redraw; // The renderer keeps the window contents between frames.
+bool redraw_all = true; // Redraw the whole window in the next frame.
+
+enum {
+	COLOR_PIN_SIZE = 30,
+	OUTLINE_THICKNESS = 2,
+	STATUS_PADDING = 4,
+};
+
+// Everything that is visible in a frame except for the canvas pixels. The state of the previous
+// frame is compared to the current one to find the parts of the window that must be redrawn.
+typedef struct {
+	SDL_Point offset;
+	float zoom;
+	int winW;
+	int winH;
+	Color left_color;
+	Color right_color;
+	SDL_Rect outline; // Window region covered by the brush outline.
+	char status[128];
+} FrameState;
+
+FrameState last_frame;
 
 // Kudos: NA16 by Nauris (https://lospec.com/palette-list/na16)
 static Color const default_palette[] = {
@@ -72,20 +108,15 @@ static SDL_Rect get_brush_rect(int size, float fx, float fy)
 	return rect;
 }
 
-static SDL_Rect render_string(Theme theme, char const *str, int x, int y, int available_height)
+// Transforms a rectangle in canvas coordinates to screen coordinates. Adjacent rectangles stay
+// adjacent on the screen without any gaps between them.
+static SDL_Rect canvas_to_screen(SDL_Rect r)
 {
-	SDL_Surface *sur = TTF_RenderUTF8_Shaded(font, str, theme.fg, theme.bg);
-	SDL_Texture *tex = SDL_CreateTextureFromSurface(ren, sur);
-	SDL_Rect rect = {0};
-	if (sur != NULL && tex != NULL) {
-		rect = (SDL_Rect) {x, y + (available_height - sur->h) / 2, sur->w, sur->h};
-		SDL_RenderCopy(ren, tex, NULL, &rect);
-	}
-	SDL_FreeSurface(sur);
-	if (tex) {
-		SDL_DestroyTexture(tex);
-	}
-	return rect;
+	int x0 = offset.x + (int) (r.x * zoom);
+	int y0 = offset.y + (int) (r.y * zoom);
+	int x1 = offset.x + (int) ((r.x + r.w) * zoom);
+	int y1 = offset.y + (int) ((r.y + r.h) * zoom);
+	return (SDL_Rect) {x0, y0, x1 - x0, y1 - y0};
 }
 
 static void fill_rect(Color color, int x, int y, int w, int h)
@@ -95,39 +126,120 @@ static void fill_rect(Color color, int x, int y, int w, int h)
 	SDL_RenderFillRect(ren, &rect);
 }
 
+static SDL_Rect render_string(Theme theme, char const *str, int x, int y, int available_height)
+{
+	int w = glyph_atlas_measure(glyphs, str);
+	int h = glyph_atlas_line_height(glyphs);
+	y += (available_height - h) / 2;
+	fill_rect(COLOR_FROM(theme.bg), x, y, w, h);
+	return glyph_atlas_render(glyphs, str, x, y, theme.fg);
+}
+
+// Returns the part of the canvas which is visible inside the window. The returned rectangle is
+// empty if the canvas is entirely off-screen.
+static SDL_Rect visible_canvas_region(void)
+{
+	int winW, winH;
+	SDL_GetRendererOutputSize(ren, &winW, &winH);
+	int x0 = MAX(0, (int) floorf(-offset.x / zoom));
+	int y0 = MAX(0, (int) floorf(-offset.y / zoom));
+	int x1 = MIN(canvas.w, (int) ceilf((winW - offset.x) / zoom));
+	int y1 = MIN(canvas.h, (int) ceilf((winH - offset.y) / zoom));
+	if (x1 <= x0 || y1 <= y0) {
+		return (SDL_Rect) {0};
+	}
+	return (SDL_Rect) {x0, y0, x1 - x0, y1 - y0};
+}
+
 static void render_canvas(Theme theme)
 {
+	// The checkerboard texture contains a small part of the pattern which is repeated over the
+	// whole canvas. Its size must be even for the pattern to line up.
+	enum { CHECKERBOARD_SIZE = 128 };
 	if (checkerboard == NULL) {
-		Color *pixels = xalloc(canvas.w * canvas.h * sizeof(Color));
-		for (int y = 0; y < canvas.h; ++y) {
-			for (int x = 0; x < canvas.w; ++x) {
-				pixels[y * canvas.w + x] = (x + y) & 1 ? 0xccccccff : 0x555555ff;
+		Color pixels[CHECKERBOARD_SIZE * CHECKERBOARD_SIZE];
+		for (int y = 0; y < CHECKERBOARD_SIZE; ++y) {
+			for (int x = 0; x < CHECKERBOARD_SIZE; ++x) {
+				pixels[y * CHECKERBOARD_SIZE + x] = (x + y) & 1 ? 0xccccccff : 0x555555ff;
 			}
 		}
-		checkerboard = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, canvas.w, canvas.h);
-		SDL_UpdateTexture(checkerboard, NULL, pixels, canvas.w * sizeof(Color));
-		free(pixels);
+		checkerboard = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, CHECKERBOARD_SIZE, CHECKERBOARD_SIZE);
+		SDL_UpdateTexture(checkerboard, NULL, pixels, CHECKERBOARD_SIZE * sizeof(Color));
 	}
+	// SDL_RenderClear would ignore the clip rectangle used for partial redraws.
 	SDL_SetRenderDrawColor(ren, theme.bg.r, theme.bg.g, theme.bg.b, theme.bg.a);
-	SDL_RenderClear(ren);
-	SDL_Rect rect = {offset.x, offset.y, (int) (canvas.w * zoom), (int) (canvas.h * zoom)};
-	SDL_RenderCopy(ren, checkerboard, NULL, &rect);
-	SDL_RenderCopy(ren, canvas.texture, NULL, &rect);
+	SDL_RenderFillRect(ren, NULL);
+
+	// Only draw the visible part of the canvas. Otherwise the renderer would have to rasterize
+	// a huge number of off-screen pixels at high zoom levels.
+	SDL_Rect visible = visible_canvas_region();
+	if (SDL_RectEmpty(&visible)) {
+		return;
+	}
+	int const cs = CHECKERBOARD_SIZE;
+	for (int y = visible.y / cs * cs; y < visible.y + visible.h; y += cs) {
+		for (int x = visible.x / cs * cs; x < visible.x + visible.w; x += cs) {
+			SDL_Rect bounds = {x, y, cs, cs};
+			SDL_Rect part;
+			SDL_IntersectRect(&bounds, &visible, &part);
+			SDL_Rect src = {part.x - x, part.y - y, part.w, part.h};
+			SDL_Rect dest = canvas_to_screen(part);
+			SDL_RenderCopy(ren, checkerboard, &src, &dest);
+		}
+	}
+
+	int size = canvas.texture_size;
+	for (int ty = visible.y / size; ty <= (visible.y + visible.h - 1) / size; ++ty) {
+		for (int tx = visible.x / size; tx <= (visible.x + visible.w - 1) / size; ++tx) {
+			SDL_Rect bounds = {tx * size, ty * size, size, size};
+			SDL_Rect part;
+			SDL_IntersectRect(&bounds, &visible, &part);
+			SDL_Rect src = {part.x - bounds.x, part.y - bounds.y, part.w, part.h};
+			SDL_Rect dest = canvas_to_screen(part);
+			SDL_RenderCopy(ren, canvas.textures[ty * canvas.textures_x + tx], &src, &dest);
+		}
+	}
 }
 
-static void render_clickable_color_pin(Color color, int x, int y, int w)
+// Computes the window position of every color in the palette.
+static void layout_palette(SDL_Rect pins[LENGTH(default_palette)])
 {
-	SDL_Rect rect = {x, y, w, w};
-	if (SDL_PointInRect(&mouse_pos, &rect)) {
-		ui_wants_mouse = true;
-		if (just_clicked[SDL_BUTTON_LEFT]) {
-			left_color = color;
+	int winW, winH;
+	SDL_GetRendererOutputSize(ren, &winW, &winH);
+	int x = 0;
+	int y = 0;
+	for (size_t i = 0; i < LENGTH(default_palette); ++i) {
+		if (y + COLOR_PIN_SIZE > winH * 8 / 10) {
+			x += COLOR_PIN_SIZE;
+			y = 0;
 		}
-		if (just_clicked[SDL_BUTTON_RIGHT]) {
-			right_color = color;
+		pins[i] = (SDL_Rect) {x, y, COLOR_PIN_SIZE, COLOR_PIN_SIZE};
+		y += COLOR_PIN_SIZE;
+	}
+}
+
+// Returns the index of the palette color below the mouse cursor, or -1 if there is none.
+static int palette_color_at_mouse(void)
+{
+	SDL_Rect pins[LENGTH(default_palette)];
+	layout_palette(pins);
+	for (size_t i = 0; i < LENGTH(default_palette); ++i) {
+		if (SDL_PointInRect(&mouse_pos, &pins[i])) {
+			return i;
 		}
 	}
+	return -1;
+}
 
+static void set_mouse_position(int x, int y)
+{
+	mouse_pos.x = x;
+	mouse_pos.y = y;
+	ui_wants_mouse = palette_color_at_mouse() >= 0;
+}
+
+static void render_color_pin(Color color, int x, int y, int w)
+{
 	fill_rect(color, x, y, w, w);
 	if (color == left_color || color == right_color) {
 		int tiny = 7;
@@ -171,129 +283,185 @@ static void render_brush_outline(void)
 	float fx = (mouse_pos.x - offset.x) / zoom;
 	float fy = (mouse_pos.y - offset.y) / zoom;
 	SDL_Rect brect = get_brush_rect(brush.size, fx, fy);
-	int const thickness = 2;
-
-	// Horizontal lines
-	for (int y = 0; y <= brush.size; ++y) {
-		int line_x = INT_MIN;
-		int line_y = offset.y + (brect.y + y) * zoom;
-		bool left = false;
-		for (int x = 0; x <= brush.size; ++x) {
-			bool cur = x < brush.size && y < brush.size && brush.stencil[y * brush.size + x];
-			bool top = y > 0 && x < brush.size && brush.stencil[(y - 1) * brush.size + x];
-			if (line_x != INT_MIN && (cur == top || cur != left)) {
-				// Finish previous line
-				int width = (offset.x + (brect.x + x) * zoom) - line_x;
-				if (!cur) {
-					width += thickness;
-				}
-				SDL_Rect rect = {line_x, line_y, width, left ? -thickness : thickness};
-				SDL_RenderFillRect(ren, &rect);
-				line_x = INT_MIN;
-			}
-			if (cur != top && line_x == INT_MIN) {
-				// Start a new line
-				line_x = offset.x + (brect.x + x) * zoom;
-				if (!left) {
-					line_x -= thickness;
-				}
-			}
-			left = cur;
-		}
+	int const thickness = OUTLINE_THICKNESS;
+
+	// Transform the cached outline of the brush to the screen and draw it all at once.
+	static SDL_Rect *rects;
+	static int rects_cap;
+	if (rects_cap < brush.noutline) {
+		rects_cap = MAX(brush.noutline, rects_cap * 2);
+		rects = xrealloc(rects, rects_cap * sizeof(SDL_Rect));
 	}
-
-	// Vertical lines
-	for (int x = 0; x <= brush.size; ++x) {
-		int line_x = offset.x + (brect.x + x) * zoom;
-		int line_y = INT_MIN;
-		bool top = false;
-		for (int y = 0; y <= brush.size; ++y) {
-			bool cur = x < brush.size && y < brush.size && brush.stencil[y * brush.size + x];
-			bool left = x > 0 && y < brush.size && brush.stencil[y * brush.size + x - 1];
-			if (line_y != INT_MIN && (cur == left || cur != top)) {
-				// Finish previous line
-				int height = (offset.y + (brect.y + y) * zoom) - line_y;
-				if (cur) {
-					height -= thickness;
-				}
-				SDL_Rect rect = {line_x, line_y, top ? -thickness : thickness, height};
-				SDL_RenderFillRect(ren, &rect);
-				line_y = INT_MIN;
-			}
-			if (cur != left && line_y == INT_MIN) {
-				// Start a new line
-				line_y = offset.y + (brect.y + y) * zoom;
-				if (top) {
-					line_y += thickness;
-				}
-			}
-			top = cur;
+	for (int i = 0; i < brush.noutline; ++i) {
+		BrushEdge e = brush.outline[i];
+		int x0 = offset.x + (brect.x + e.x0) * zoom;
+		int y0 = offset.y + (brect.y + e.y0) * zoom;
+		int x1 = offset.x + (brect.x + e.x1) * zoom;
+		int y1 = offset.y + (brect.y + e.y1) * zoom;
+		if (e.y0 == e.y1) {
+			x0 += e.start_pad * thickness;
+			x1 += e.end_pad * thickness;
+			int y = e.side < 0 ? y0 - thickness : y0;
+			rects[i] = (SDL_Rect) {x0, y, x1 - x0, thickness};
+		} else {
+			y0 += e.start_pad * thickness;
+			y1 += e.end_pad * thickness;
+			int x = e.side < 0 ? x0 - thickness : x0;
+			rects[i] = (SDL_Rect) {x, y0, thickness, y1 - y0};
 		}
 	}
+	SDL_RenderFillRects(ren, rects, brush.noutline);
 
 	SDL_SetRenderDrawBlendMode(ren, old_blend);
 }
 
-static void render_user_interface(Theme theme)
+static bool brush_outline_visible(void)
 {
-	if (!panning && (!ui_wants_mouse || drawing) && tool <= ERASER) {
-		render_brush_outline();
-	}
-
-	int winW, winH;
-	SDL_GetRendererOutputSize(ren, &winW, &winH);
-	ui_wants_mouse = false;
-	int x = 0;
-	int y = 0;
-	int color_width = 30;
-	for (size_t i = 0; i < LENGTH(default_palette); ++i) {
-		if (y + color_width > winH * 8 / 10) {
-			x += color_width;
-			y = 0;
-		}
-		render_clickable_color_pin(default_palette[i], x, y, color_width);
-		y += color_width;
-	}
+	return !panning && (!ui_wants_mouse || drawing) && tool <= ERASER;
+}
 
-	Color c[] = {right_color, left_color};
-	for (int i = 0; i < 2; ++i) {
-		char str[32];
-		snprintf(str, LENGTH(str), " #%02X%02X%02X", RED(c[i]), GREEN(c[i]), BLUE(c[i]));
-		int x = winW - 80 - color_width;
-		int y = winH - color_width * (i + 1);
-		fill_rect(c[i], x, y, color_width, color_width);
-		render_string(theme, str, x + color_width, y, color_width);
+// Returns the window region covered by the brush outline. The rectangle is empty if the outline
+// is hidden.
+static SDL_Rect brush_outline_bounds(void)
+{
+	if (!brush_outline_visible()) {
+		return (SDL_Rect) {0};
 	}
+	float fx = (mouse_pos.x - offset.x) / zoom;
+	float fy = (mouse_pos.y - offset.y) / zoom;
+	SDL_Rect r = canvas_to_screen(get_brush_rect(brush.size, fx, fy));
+	// One extra pixel because the outline rounds its coordinates slightly differently.
+	int const margin = OUTLINE_THICKNESS + 1;
+	return (SDL_Rect) {r.x - margin, r.y - margin, r.w + 2 * margin, r.h + 2 * margin};
+}
 
+static void format_status(char status[128])
+{
 	char const * const tool_name[TOOL_COUNT] = {
 		[BRUSH_ROUND] = "Round brush",
 		[BRUSH_SQUARE] = "Square brush",
 		[ERASER] = "Eraser",
 		[COLOR_PICKER] = "Color picker",
 		[BUCKET_FILL] = "Bucket",
+		[REPLACE_COLOR] = "Replace color",
 	};
 
-	char status[128];
 	if (SDL_GetTicks64() < error_timeout) {
-		strncpy(status, error_text, LENGTH(status));
-		status[LENGTH(status) - 1] = 0;
+		strncpy(status, error_text, 128);
+		status[127] = 0;
+	} else if (image_loader != NULL && image_load_cancelled(image_loader)) {
+		strcpy(status, "Cancelling...");
+	} else if (image_loader != NULL) {
+		sprintf(status, "Loading image %d%% (Esc to cancel)", (int) (image_load_progress(image_loader) * 100));
 	} else {
 		int len = 0;
 		if (tool <= ERASER) {
 			len += sprintf(status, "%s (%d)", tool_name[tool], brush.size);
+		} else if (tool == BUCKET_FILL) {
+			len += sprintf(status, "%s (tolerance %d%%)", tool_name[tool], fill_tolerance);
 		} else {
 			len += sprintf(status, "%s", tool_name[tool]);
 		}
-		sprintf(status + len, " | History: %d/%d%s", canvas.undo_left,
-			canvas.undo_left + canvas.redo_left, canvas.unsaved ? " [ + ]" : "");
+		float const mb = 1024.0f * 1024.0f;
+		len += sprintf(status + len, " | History: %d/%d (%.1f/%.0f MB)%s", canvas.undo_left,
+			canvas.undo_left + canvas.redo_left, canvas.history_bytes / mb,
+			canvas.history_budget / mb, (image_saver != NULL && !save_detached) ? " [ saving ]" : canvas.unsaved ? " [ + ]" : "");
+#ifdef DEVELOPER
+		sprintf(status + len, " | Upload: %zu KB", canvas.uploaded_bytes / 1024);
+#endif
+	}
+}
+
+// Compares the new frame to the last one and returns the window region that has changed. The
+// returned rectangle is empty if the frame looks exactly like the previous one.
+static SDL_Rect find_damage(FrameState const *frame)
+{
+	FrameState const *last = &last_frame;
+	SDL_Rect window = {0, 0, frame->winW, frame->winH};
+	if (redraw_all || frame->offset.x != last->offset.x || frame->offset.y != last->offset.y
+		|| frame->zoom != last->zoom || frame->winW != last->winW || frame->winH != last->winH
+		|| frame->left_color != last->left_color || frame->right_color != last->right_color) {
+		return window;
 	}
 
-	int padding = 4;
-	int tw = 0;
-	int th = 0;
-	TTF_SizeUTF8(font, status, &tw, &th);
-	fill_rect(COLOR_FROM(theme.bg), 0, winH - th, tw + padding * 2, th);
-	render_string(theme, status, padding, winH - th, th);
+	SDL_Rect damage = {0};
+	if (!SDL_RectEmpty(&canvas.uploaded_region)) {
+		SDL_Rect rect = canvas_to_screen(canvas.uploaded_region);
+		SDL_UnionRect(&damage, &rect, &damage);
+	}
+	if (!SDL_RectEquals(&frame->outline, &last->outline)) {
+		SDL_UnionRect(&damage, &frame->outline, &damage);
+		SDL_UnionRect(&damage, &last->outline, &damage);
+	}
+	if (strcmp(frame->status, last->status) != 0) {
+		int tw = MAX(glyph_atlas_measure(glyphs, frame->status), glyph_atlas_measure(glyphs, last->status));
+		int th = glyph_atlas_line_height(glyphs);
+		SDL_Rect rect = {0, frame->winH - th, tw + STATUS_PADDING * 2, th};
+		SDL_UnionRect(&damage, &rect, &damage);
+	}
+	SDL_IntersectRect(&damage, &window, &damage);
+	return damage;
+}
+
+static void render_user_interface(Theme theme, FrameState const *frame)
+{
+	if (brush_outline_visible()) {
+		render_brush_outline();
+	}
+
+	int winW = frame->winW;
+	int winH = frame->winH;
+	SDL_Rect pins[LENGTH(default_palette)];
+	layout_palette(pins);
+	for (size_t i = 0; i < LENGTH(default_palette); ++i) {
+		render_color_pin(default_palette[i], pins[i].x, pins[i].y, COLOR_PIN_SIZE);
+	}
+
+	Color c[] = {right_color, left_color};
+	for (int i = 0; i < 2; ++i) {
+		char str[32];
+		snprintf(str, LENGTH(str), " #%02X%02X%02X", RED(c[i]), GREEN(c[i]), BLUE(c[i]));
+		int x = winW - 80 - COLOR_PIN_SIZE;
+		int y = winH - COLOR_PIN_SIZE * (i + 1);
+		fill_rect(c[i], x, y, COLOR_PIN_SIZE, COLOR_PIN_SIZE);
+		render_string(theme, str, x + COLOR_PIN_SIZE, y, COLOR_PIN_SIZE);
+	}
+
+	int tw = glyph_atlas_measure(glyphs, frame->status);
+	int th = glyph_atlas_line_height(glyphs);
+	fill_rect(COLOR_FROM(theme.bg), 0, winH - th, tw + STATUS_PADDING * 2, th);
+	render_string(theme, frame->status, STATUS_PADDING, winH - th, th);
+}
+
+// Draws the next frame. Nothing is drawn if the frame would look the same as the previous one.
+static void render_frame(Theme theme)
+{
+	FrameState frame = {
+		.offset = offset,
+		.zoom = zoom,
+		.left_color = left_color,
+		.right_color = right_color,
+		.outline = brush_outline_bounds(),
+	};
+	SDL_GetRendererOutputSize(ren, &frame.winW, &frame.winH);
+	format_status(frame.status);
+
+	SDL_Rect damage = find_damage(&frame);
+	redraw_all = false;
+	last_frame = frame;
+	if (SDL_RectEmpty(&damage)) {
+		return;
+	}
+
+	// Other renderers do not guarantee that the back buffer survives SDL_RenderPresent, so they
+	// still have to redraw everything once something has changed.
+	if (partial_redraw) {
+		SDL_RenderSetClipRect(ren, &damage);
+	}
+	render_canvas(theme);
+	render_user_interface(theme, &frame);
+	SDL_RenderSetClipRect(ren, NULL);
+	SDL_RenderPresent(ren);
 }
 
 static void show_error(char const *format, ...) __attribute__ ((format (printf, 1, 2)));
@@ -306,115 +474,102 @@ static void show_error(char const *format, ...)
 	error_timeout = SDL_GetTicks64() + 2500;
 }
 
-static void use_brush(bool round, int size, Color color, float fx, float fy)
+// Paints the pixels from x0 to x1 (exclusive) in the given row of the canvas.
+static void fill_row(int y, int x0, int x1, Color color)
+{
+	if (x0 < x1) {
+		kernel_fill(&canvas.pixels[y * canvas.w + x0], x1 - x0, color);
+	}
+}
+
+// Stamps the brush with its top-left corner at pos. Pixels which were already painted by the
+// previous stamp at prev are skipped. Pass NULL for prev to paint the whole brush.
+static void stamp_brush(SDL_Point pos, Color color, SDL_Point const *prev)
 {
-	SDL_Rect rect = get_brush_rect(size, fx, fy);
+	SDL_Rect rect = {pos.x, pos.y, brush.size, brush.size};
 	SDL_Rect bbox = {0, 0, canvas.w, canvas.h};
 	SDL_Rect clip;
-	SDL_IntersectRect(&bbox, &rect, &clip);
+	if (!SDL_IntersectRect(&bbox, &rect, &clip)) {
+		return;
+	}
+	canvas_touch(&canvas, clip);
 
 	for (int y = clip.y; y < clip.y + clip.h; ++y) {
-		for (int x = clip.x; x < clip.x + clip.w; ++x) {
-			int si = (y - rect.y) * brush.size + (x - rect.x);
-			assert(si < brush.size * brush.size);
-			if (brush.stencil[si]) {
-				int index = y * canvas.w + x;
-				assert(index >= 0 && index < canvas.w * canvas.h);
-				canvas.pixels[index] = color;
-			}
+		BrushSpan span = brush.spans[y - rect.y];
+		int x0 = MAX(clip.x, rect.x + span.start);
+		int x1 = MIN(clip.x + clip.w, rect.x + span.start + span.len);
+		int py = prev != NULL ? y - prev->y : -1;
+		if (py >= 0 && py < brush.size) {
+			// Only paint the parts of the span to the left and right of the previous stamp.
+			int p0 = prev->x + brush.spans[py].start;
+			int p1 = p0 + brush.spans[py].len;
+			fill_row(y, x0, MIN(x1, p0), color);
+			fill_row(y, MAX(x0, p1), x1, color);
+		} else {
+			fill_row(y, x0, x1, color);
 		}
 	}
 
 	canvas_mark_dirty(&canvas, clip);
 }
 
-static void pick_color(Color *out, float fx, float fy)
+// Starts a new brush stroke at the given position.
+static void begin_stroke(Color color, float fx, float fy)
 {
-	int x = (int) fx;
-	int y = (int) fy;
-	if (x >= 0 && y >= 0 && x < canvas.w && y < canvas.h) {
-		*out = canvas.pixels[y * canvas.w + x];
-	}
+	SDL_Rect rect = get_brush_rect(brush.size, fx, fy);
+	stroke_pos = (SDL_Point) {rect.x, rect.y};
+	stroke_brush = brush;
+	stroking = true;
+	stamp_brush(stroke_pos, color, NULL);
 }
 
-// Internal function for bucket_fill.
-static void bucket_fill__scan(int from, int to, int y, Color replace_this, SDL_Point *stack, int stack_cap, int *s)
+// Continues the current stroke to the given position. The brush is stamped at every pixel of the
+// line from the last position, so fast mouse movements do not leave gaps. As every stamp only
+// paints the pixels the previous one did not cover, each pixel on a straight line is painted once.
+static void continue_stroke(Color color, float fx, float fy)
 {
-	bool span_added = false;
-	for (int x = from; x <= to; ++x) {
-		if (canvas.pixels[y * canvas.w + x] != replace_this) {
-			span_added = false;
-		} else if (!span_added) {
-			if (*s + 1 > stack_cap) {
-				return;
-			}
-			stack[(*s)++] = (SDL_Point) {x, y};
-			span_added = true;
+	SDL_Rect rect = get_brush_rect(brush.size, fx, fy);
+	SDL_Point end = {rect.x, rect.y};
+
+	// Bresenham's line algorithm
+	int dx = abs(end.x - stroke_pos.x);
+	int dy = -abs(end.y - stroke_pos.y);
+	int sx = stroke_pos.x < end.x ? 1 : -1;
+	int sy = stroke_pos.y < end.y ? 1 : -1;
+	int err = dx + dy;
+	SDL_Point pos = stroke_pos;
+	while (pos.x != end.x || pos.y != end.y) {
+		SDL_Point prev = pos;
+		int e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			pos.x += sx;
 		}
+		if (e2 <= dx) {
+			err += dx;
+			pos.y += sy;
+		}
+		stamp_brush(pos, color, &prev);
 	}
+	stroke_pos = end;
 }
 
-// A moderately efficient Span-Filling algorithm from Wikipedia
-// https://en.wikipedia.org/wiki/Flood_fill#Span_Filling
-static void bucket_fill(float fx, float fy, Color color)
+// Returns the color painted by the brush tools with the given mouse button.
+static Color brush_color(int button)
 {
-	int x = (int) fx;
-	int y = (int) fy;
-	if (x < 0 || y < 0 || x >= canvas.w || y >= canvas.h) {
-		return;
-	}
-
-	enum { STACK_CAP = 128 };
-	SDL_Point stack[STACK_CAP];
-	int s = 0;
-	Color replace_this = canvas.pixels[y * canvas.w + x];
-	int minX = x, maxX = x;
-	int minY = y, maxY = y;
-	stack[s++] = (SDL_Point) {x, y};
-
-	if (replace_this == color) {
-		// Fast out, replacing a color by itself has no effect.
-		return;
+	if (tool == ERASER) {
+		return 0;
 	}
+	return button == SDL_BUTTON_LEFT ? left_color : right_color;
+}
 
-	while (s > 0) {
-		SDL_Point p = stack[--s];
-
-		int from = p.x;
-		while (from > 0 && canvas.pixels[p.y * canvas.w + from - 1] == replace_this) {
-			canvas.pixels[p.y * canvas.w + from - 1] = color;
-			--from;
-		}
-
-		int to = p.x;
-		while (to < canvas.w && canvas.pixels[p.y * canvas.w + to] == replace_this) {
-			canvas.pixels[p.y * canvas.w + to] = color;
-			++to;
-		}
-		--to;
-
-		if (from < minX) {
-			minX = from;
-		}
-		if (to > maxX) {
-			maxX = to;
-		}
-		if (p.y < minY) {
-			minY = p.y;
-		} else if (p.y > maxY) {
-			maxY = p.y;
-		}
-
-		if (p.y > 0) {
-			bucket_fill__scan(from, to, p.y - 1, replace_this, stack, STACK_CAP, &s);
-		}
-		if (p.y + 1 < canvas.h) {
-			bucket_fill__scan(from, to, p.y + 1, replace_this, stack, STACK_CAP, &s);
-		}
+static void pick_color(Color *out, float fx, float fy)
+{
+	int x = (int) fx;
+	int y = (int) fy;
+	if (x >= 0 && y >= 0 && x < canvas.w && y < canvas.h) {
+		*out = canvas.pixels[y * canvas.w + x];
 	}
-
-	SDL_Rect changed = {minX, minY, maxX - minX + 1, maxY - minY + 1};
-	canvas_mark_dirty(&canvas, changed);
 }
 
 static void tool_on_click(int button)
@@ -424,17 +579,12 @@ static void tool_on_click(int button)
 	}
 	float fx = (mouse_pos.x - offset.x) / zoom;
 	float fy = (mouse_pos.y - offset.y) / zoom;
-	Color color = button == SDL_BUTTON_LEFT ? left_color : right_color;
 
 	switch (tool) {
 	case BRUSH_ROUND:
-		use_brush(true, brush.size, color, fx, fy);
-		break;
 	case BRUSH_SQUARE:
-		use_brush(false, brush.size, color, fx, fy);
-		break;
 	case ERASER:
-		use_brush(true, brush.size, 0, fx, fy);
+		begin_stroke(brush_color(button), fx, fy);
 		break;
 	case COLOR_PICKER:
 		if (button == SDL_BUTTON_LEFT) {
@@ -445,9 +595,16 @@ static void tool_on_click(int button)
 		break;
 	case BUCKET_FILL:
 		if (button == SDL_BUTTON_LEFT) {
-			bucket_fill(fx, fy, left_color);
+			flood_fill(&canvas, (int) floorf(fx), (int) floorf(fy), left_color, fill_tolerance * 255 / 100);
 		} else {
-			bucket_fill(fx, fy, right_color);
+			flood_fill(&canvas, (int) floorf(fx), (int) floorf(fy), right_color, fill_tolerance * 255 / 100);
+		}
+		break;
+	case REPLACE_COLOR:
+		if (button == SDL_BUTTON_LEFT) {
+			replace_color(&canvas, (int) floorf(fx), (int) floorf(fy), left_color);
+		} else {
+			replace_color(&canvas, (int) floorf(fx), (int) floorf(fy), right_color);
 		}
 		break;
 	case TOOL_COUNT:
@@ -457,8 +614,18 @@ static void tool_on_click(int button)
 
 static void tool_on_move(void)
 {
+	if (active_button != SDL_BUTTON_LEFT && active_button != SDL_BUTTON_RIGHT) {
+		return;
+	}
 	if (tool == BRUSH_ROUND || tool == BRUSH_SQUARE || tool == ERASER) {
-		tool_on_click(active_button);
+		float fx = (mouse_pos.x - offset.x) / zoom;
+		float fy = (mouse_pos.y - offset.y) / zoom;
+		// Skipping pixels covered by the previous stamp only works if the brush has not changed.
+		if (stroking && stroke_brush.size == brush.size && stroke_brush.round == brush.round) {
+			continue_stroke(brush_color(active_button), fx, fy);
+		} else {
+			begin_stroke(brush_color(active_button), fx, fy);
+		}
 	}
 }
 
@@ -489,6 +656,12 @@ static void set_cursor(SDL_SystemCursor cursor)
 	}
 }
 
+// Selects the mouse cursor for the current state.
+static void update_cursor(void)
+{
+	set_cursor(panning ? SDL_SYSTEM_CURSOR_HAND : SDL_SYSTEM_CURSOR_ARROW);
+}
+
 // Makes the canvas visible again if it goes too far off the screen.
 static void constrain_canvas(void)
 {
@@ -537,31 +710,57 @@ static void change_zoom(int amount)
 
 typedef enum { SAVE, SAVE_AS } SaveMethod;
 
+// Starts saving the canvas in the background. The user may be prompted to enter a filepath if the
+// canvas has not yet been associated with a file. Returns false if the save could not be started.
 static bool save_file(SaveMethod method)
 {
-	CanvasFileStatus status;
-	if (method == SAVE) {
-		status = canvas_save_to_file(&canvas, NULL);
-	} else {
-		status = canvas_save_as_to_file(&canvas);
+	if (image_saver != NULL) {
+		show_error("The image is still being saved");
+		return false;
 	}
-	switch (status) {
-	case CF_OK:
+	if (method == SAVE && !canvas.unsaved && canvas.filepath != NULL) {
 		return true;
-	case CF_CANCELLED_BY_USER:
-		break;
-	case CF_UNKNOWN_IMAGE_FORMAT:
+	}
+
+	char *filepath = NULL;
+	if (method == SAVE_AS) {
+		filepath = dialog_save_file("Save File As");
+	} else if (canvas.filepath == NULL) {
+		filepath = dialog_save_file("Save File");
+	} else {
+		filepath = xstrdup(canvas.filepath);
+	}
+	if (filepath == NULL) {
+		return false;
+	}
+
+	image_saver = image_save_async(&canvas, filepath);
+	free(filepath);
+	if (image_saver == NULL) {
 		show_error("Could not save image: Unsupported image format");
-		break;
-	case CF_OTHER_ERROR:
+		return false;
+	}
+	save_detached = false;
+	return true;
+}
+
+// Waits until the current save is written. Returns false if it has failed.
+static bool finish_save_file(void)
+{
+	bool success = image_save_finish(image_saver, save_detached ? NULL : &canvas);
+	image_saver = NULL;
+	if (!success) {
 		show_error("Could not save image: I/O error");
-		break;
 	}
-	return false;
+	return success;
 }
 
 static bool can_close_canvas(void)
 {
+	if (image_saver != NULL) {
+		// The result of a pending save decides whether the canvas is still unsaved.
+		finish_save_file();
+	}
 	if (!canvas.unsaved) {
 		return true;
 	}
@@ -569,7 +768,7 @@ static bool can_close_canvas(void)
 	case DIALOG_RESPONSE_CANCEL:
 		return false;
 	case DIALOG_RESPONSE_SAVE:
-		return save_file(SAVE);
+		return save_file(SAVE) && finish_save_file();
 	case DIALOG_RESPONSE_DISCARD:
 		return true;
 	}
@@ -615,11 +814,13 @@ static void set_canvas(Canvas new_canvas)
 {
 	canvas_free(canvas);
 	canvas = new_canvas;
-	if (checkerboard != NULL) {
-		SDL_DestroyTexture(checkerboard);
-		checkerboard = NULL;
-	}
+	save_detached = image_saver != NULL;
+	canvas.history_budget = history_budget;
 	center_canvas();
+	redraw_all = true;
+	// A stroke must not continue on the new canvas.
+	drawing = false;
+	stroking = false;
 }
 
 enum {
@@ -660,9 +861,19 @@ static void ka_change_tool(Arg arg, SDL_Keycode key, uint16_t mod)
 	}
 }
 
+// Changes the brush size, or the tolerance while the bucket tool is active.
+static void resize_tool(int delta)
+{
+	if (tool == BUCKET_FILL) {
+		fill_tolerance = MIN(MAX(fill_tolerance + delta, 0), 100);
+	} else {
+		brush_resize(&brush, delta);
+	}
+}
+
 static void ka_brush_size(Arg arg, SDL_Keycode key, uint16_t mod)
 {
-	brush_resize(&brush, arg.i);
+	resize_tool(arg.i);
 }
 
 static void ka_undo_redo(Arg arg, SDL_Keycode key, uint16_t mod)
@@ -681,7 +892,8 @@ static void ka_save_file(Arg arg, SDL_Keycode key, uint16_t mod)
 
 static void ka_open_file(Arg arg, SDL_Keycode key, uint16_t mod)
 {
-	if (!can_close_canvas()) {
+	if (image_loader != NULL) {
+		show_error("Another image is still being opened");
 		return;
 	}
 
@@ -689,14 +901,37 @@ static void ka_open_file(Arg arg, SDL_Keycode key, uint16_t mod)
 	if (filepath == NULL) {
 		return;
 	}
+	// The canvas stays editable while the image is decoded. Unsaved changes are handled once the
+	// image is ready.
+	image_loader = image_load_async(filepath);
+	free(filepath);
+}
 
+static void ka_cancel(Arg arg, SDL_Keycode key, uint16_t mod)
+{
+	if (image_loader != NULL) {
+		image_load_cancel(image_loader);
+	}
+}
+
+// Replaces the canvas with the image of the finished loader.
+static void finish_open_file(void)
+{
+	ImageLoader *loader = image_loader;
+	image_loader = NULL;
+	bool cancelled = image_load_cancelled(loader);
 	Canvas new_canvas;
-	char const *err = canvas_open_image(&new_canvas, filepath, ren);
-	free(filepath);
-	if (err == NULL) {
+	char const *err = image_load_finish(loader, &new_canvas, ren);
+	if (cancelled) {
+		if (err == NULL) {
+			canvas_free(new_canvas);
+		}
+	} else if (err != NULL) {
+		show_error("Could not open image: %s", err);
+	} else if (can_close_canvas()) {
 		set_canvas(new_canvas);
 	} else {
-		show_error("Could not open image: %s", err);
+		canvas_free(new_canvas);
 	}
 }
 
@@ -728,6 +963,7 @@ static KeyAction const key_down_actions[] = {
 	{ SDLK_b,       KMOD_LSHIFT, 0,            ka_change_tool, {.i = BRUSH_SQUARE} },
 	{ SDLK_b,       0,           0,            ka_change_tool, {.i = BRUSH_ROUND} },
 	{ SDLK_e,       0,           0,            ka_change_tool, {.i = ERASER} },
+	{ SDLK_g,       KMOD_LSHIFT, 0,            ka_change_tool, {.i = REPLACE_COLOR} },
 	{ SDLK_g,       0,           0,            ka_change_tool, {.i = BUCKET_FILL} },
 	{ SDLK_LEFTBRACKET,  0,      ALLOW_REPEAT, ka_brush_size,  {.i = -1} },
 	{ SDLK_RIGHTBRACKET, 0,      ALLOW_REPEAT, ka_brush_size,  {.i =  1} },
@@ -739,6 +975,7 @@ static KeyAction const key_down_actions[] = {
 	{ SDLK_o,       KMOD_LCTRL,  0,            ka_open_file,   {0} },
 	{ SDLK_n,       KMOD_LCTRL,  0,            ka_new_file,    {0} },
 	{ SDLK_q,       KMOD_LCTRL,  0,            ka_quit,        {0} },
+	{ SDLK_ESCAPE,  0,           0,            ka_cancel,      {0} },
 };
 
 static KeyAction const key_up_actions[] = {
@@ -749,13 +986,23 @@ static KeyAction const key_up_actions[] = {
 
 static void poll_events()
 {
-	// Reset io state
-	for (size_t i = 0; i < LENGTH(just_clicked); ++i) {
-		just_clicked[i] = false;
+	// Use idle time to compress old undo points until new events arrive.
+	SDL_PumpEvents();
+	while (!SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT) && canvas_compact_history(&canvas)) {
+		SDL_PumpEvents();
 	}
 
 	// TODO: Fix strange scroll wheel bug when using SDL_WaitEvent.
-	SDL_WaitEvent(NULL);
+	Uint64 now = SDL_GetTicks64();
+	if (image_loader != NULL) {
+		// Wake up regularly to update the progress in the status bar.
+		SDL_WaitEventTimeout(NULL, 100);
+	} else if (now < error_timeout) {
+		// Wake up in time to remove the error message.
+		SDL_WaitEventTimeout(NULL, (int) (error_timeout - now) + 1);
+	} else {
+		SDL_WaitEvent(NULL);
+	}
 
 	SDL_Event e;
 	while (SDL_PollEvent(&e)) {
@@ -763,6 +1010,11 @@ static void poll_events()
 		case SDL_QUIT:
 			try_quit_application();
 			break;
+		case SDL_WINDOWEVENT:
+			// The palette layout depends on the window size.
+			set_mouse_position(mouse_pos.x, mouse_pos.y);
+			redraw_all = true;
+			break;
 		case SDL_KEYDOWN:
 			for (size_t i = 0; i < LENGTH(key_down_actions); ++i) {
 				KeyAction a = key_down_actions[i];
@@ -788,18 +1040,24 @@ static void poll_events()
 			if (SDL_GetModState() & KMOD_LCTRL) {
 				change_zoom(y);
 			} else {
-				brush_resize(&brush, y);
+				resize_tool(y);
 			}
 			break;
 		}
 		case SDL_MOUSEBUTTONDOWN: {
 			SDL_Keymod mod = SDL_GetModState();
 			int button = e.button.button;
-			just_clicked[button] = true;
+			set_mouse_position(e.button.x, e.button.y);
+			int pin = palette_color_at_mouse();
 			if (button == SDL_BUTTON_MIDDLE || ((mod & KMOD_LCTRL) && button == SDL_BUTTON_LEFT)) {
-				set_cursor(SDL_SYSTEM_CURSOR_HAND);
 				panning = true;
-			} else if (!ui_wants_mouse) {
+			} else if (pin >= 0) {
+				if (button == SDL_BUTTON_LEFT) {
+					left_color = default_palette[pin];
+				} else if (button == SDL_BUTTON_RIGHT) {
+					right_color = default_palette[pin];
+				}
+			} else {
 				drawing = true;
 				active_button = button;
 				tool_on_click(active_button);
@@ -808,19 +1066,18 @@ static void poll_events()
 		}
 		case SDL_MOUSEBUTTONUP:
 			if (panning) {
-				set_cursor(SDL_SYSTEM_CURSOR_ARROW);
 				panning = false;
 			} else if (e.button.button == active_button) {
 				if (drawing) {
 					canvas_commit(&canvas);
 				}
 				drawing = false;
+				stroking = false;
 				active_button = 0;
 			}
 			break;
 		case SDL_MOUSEMOTION:
-			mouse_pos.x = e.motion.x;
-			mouse_pos.y = e.motion.y;
+			set_mouse_position(e.motion.x, e.motion.y);
 			if (panning) {
 				offset.x += e.motion.xrel;
 				offset.y += e.motion.yrel;
@@ -829,15 +1086,28 @@ static void poll_events()
 				tool_on_move();
 			}
 			break;
+		default:
+			// A save may already have been finished by can_close_canvas. Its event is ignored then.
+			if (e.type == image_event_type() && e.user.code == IMAGE_LOADED && e.user.data1 == image_loader) {
+				finish_open_file();
+			} else if (e.type == image_event_type() && e.user.code == IMAGE_SAVED && e.user.data1 == image_saver) {
+				finish_save_file();
+			}
+			break;
 		}
 	}
 }
 
 static void cleanup(void)
 {
+	glyph_atlas_free(glyphs);
 	TTF_CloseFont(font);
 	TTF_Quit();
 
+	image_load_discard(image_loader);
+	if (image_saver != NULL) {
+		image_save_finish(image_saver, NULL);
+	}
 	brush_free(brush);
 	canvas_free(canvas);
 
@@ -850,6 +1120,7 @@ static void cleanup(void)
 int main(int argc, char *argv[])
 {
 	atexit(cleanup);
+	kernel_init();
 
 	if (SDL_Init(SDL_INIT_VIDEO) || TTF_Init()) {
 		fatalSDL("Could not initialize SDL2");
@@ -874,8 +1145,20 @@ int main(int argc, char *argv[])
 			fatalSDL("Could not create renderer");
 		}
 	}
+	glyphs = glyph_atlas_create(ren, font);
+
+	// The software renderer draws directly into the window surface, which keeps its contents
+	// between frames. Only the changed parts of the window have to be redrawn there.
+	SDL_RendererInfo info;
+	partial_redraw = SDL_GetRendererInfo(ren, &info) == 0 && (info.flags & SDL_RENDERER_SOFTWARE);
+
+	char const *budget = getenv("PIXELFISH_HISTORY_MB");
+	if (budget != NULL && atoi(budget) > 0) {
+		history_budget = (size_t) atoi(budget) << 20;
+	}
 
 	canvas = canvas_create_with_background(60, 40, 0x00000000, ren);
+	canvas.history_budget = history_budget;
 	center_canvas();
 	brush = brush_create(5, true);
 	left_color = default_palette[0];
@@ -883,9 +1166,9 @@ int main(int argc, char *argv[])
 
 	while (running) {
 		poll_events();
-		render_canvas(dark_theme);
-		render_user_interface(dark_theme);
-		SDL_RenderPresent(ren);
+		update_cursor();
+		canvas_flush_texture(&canvas);
+		render_frame(dark_theme);
 	}
 
 	return EXIT_SUCCESS;
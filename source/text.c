@@ -0,0 +1,129 @@
+#include "text.h"
+#include "util.h"
+
+enum {
+	FIRST_GLYPH = ' ',
+	LAST_GLYPH = '~',
+	GLYPH_COUNT = LAST_GLYPH - FIRST_GLYPH + 1,
+	ATLAS_WIDTH = 512,
+};
+
+struct GlyphAtlas {
+	SDL_Renderer *ren;
+	SDL_Texture *texture;
+	int line_height;
+	SDL_Rect src[GLYPH_COUNT]; // Position of every glyph inside the texture
+	int advance[GLYPH_COUNT];
+	short kerning[GLYPH_COUNT][GLYPH_COUNT]; // Indexed by [previous][current]
+};
+
+GlyphAtlas *glyph_atlas_create(SDL_Renderer *ren, TTF_Font *font)
+{
+	GlyphAtlas *atlas = xalloc(sizeof(GlyphAtlas));
+	atlas->ren = ren;
+	atlas->line_height = TTF_FontHeight(font);
+
+	SDL_Color white = {255, 255, 255, 255};
+	SDL_Surface *glyphs[GLYPH_COUNT];
+	int x = 0;
+	int y = 0;
+	for (int i = 0; i < GLYPH_COUNT; ++i) {
+		Uint16 ch = FIRST_GLYPH + i;
+		glyphs[i] = TTF_RenderGlyph_Blended(font, ch, white);
+		if (glyphs[i] == NULL) {
+			fatalSDL("TTF_RenderGlyph_Blended");
+		}
+		if (x + glyphs[i]->w > ATLAS_WIDTH) {
+			x = 0;
+			y += atlas->line_height;
+		}
+		atlas->src[i] = (SDL_Rect) {x, y, glyphs[i]->w, glyphs[i]->h};
+		x += glyphs[i]->w;
+		TTF_GlyphMetrics(font, ch, NULL, NULL, NULL, NULL, &atlas->advance[i]);
+		for (int prev = 0; prev < GLYPH_COUNT; ++prev) {
+			atlas->kerning[prev][i] = TTF_GetFontKerningSizeGlyphs(font, FIRST_GLYPH + prev, ch);
+		}
+	}
+
+	SDL_Surface *sheet = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, y + atlas->line_height, 32, SDL_PIXELFORMAT_ARGB8888);
+	if (sheet == NULL) {
+		fatalSDL("SDL_CreateRGBSurfaceWithFormat");
+	}
+	for (int i = 0; i < GLYPH_COUNT; ++i) {
+		// Copy the alpha channel instead of blending the glyph onto the empty sheet.
+		SDL_SetSurfaceBlendMode(glyphs[i], SDL_BLENDMODE_NONE);
+		SDL_Rect dest = atlas->src[i];
+		SDL_BlitSurface(glyphs[i], NULL, sheet, &dest);
+		SDL_FreeSurface(glyphs[i]);
+	}
+	atlas->texture = SDL_CreateTextureFromSurface(ren, sheet);
+	SDL_FreeSurface(sheet);
+	if (atlas->texture == NULL) {
+		fatalSDL("SDL_CreateTextureFromSurface");
+	}
+	SDL_SetTextureBlendMode(atlas->texture, SDL_BLENDMODE_BLEND);
+	return atlas;
+}
+
+void glyph_atlas_free(GlyphAtlas *atlas)
+{
+	if (atlas != NULL) {
+		SDL_DestroyTexture(atlas->texture);
+		free(atlas);
+	}
+}
+
+int glyph_atlas_line_height(GlyphAtlas const *atlas)
+{
+	return atlas->line_height;
+}
+
+// Returns the index of the glyph for the next character in str and advances str past it.
+static int next_glyph(char const **str)
+{
+	unsigned char c = *(*str)++;
+	if (c >= 0x80) {
+		// Skip the continuation bytes of a multi-byte sequence.
+		while ((**str & 0xc0) == 0x80) {
+			++*str;
+		}
+		c = '?';
+	} else if (c < FIRST_GLYPH || c > LAST_GLYPH) {
+		c = '?';
+	}
+	return c - FIRST_GLYPH;
+}
+
+int glyph_atlas_measure(GlyphAtlas const *atlas, char const *str)
+{
+	int width = 0;
+	int prev = -1;
+	while (*str) {
+		int g = next_glyph(&str);
+		if (prev >= 0) {
+			width += atlas->kerning[prev][g];
+		}
+		width += atlas->advance[g];
+		prev = g;
+	}
+	return width;
+}
+
+SDL_Rect glyph_atlas_render(GlyphAtlas *atlas, char const *str, int x, int y, SDL_Color color)
+{
+	SDL_SetTextureColorMod(atlas->texture, color.r, color.g, color.b);
+	SDL_SetTextureAlphaMod(atlas->texture, color.a);
+	int pen = x;
+	int prev = -1;
+	while (*str) {
+		int g = next_glyph(&str);
+		if (prev >= 0) {
+			pen += atlas->kerning[prev][g];
+		}
+		SDL_Rect dest = {pen, y, atlas->src[g].w, atlas->src[g].h};
+		SDL_RenderCopy(atlas->ren, atlas->texture, &atlas->src[g], &dest);
+		pen += atlas->advance[g];
+		prev = g;
+	}
+	return (SDL_Rect) {x, y, pen - x, atlas->line_height};
+}
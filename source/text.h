@@ -0,0 +1,24 @@
+// Text rendering through a glyph atlas. All printable ASCII glyphs of a font are rasterized into a
+// single texture once, so drawing a string does not allocate any surfaces or textures. Characters
+// outside of the ASCII range are displayed as question marks.
+#pragma once
+
+#include <SDL2/SDL_render.h>
+#include <SDL2/SDL_ttf.h>
+
+typedef struct GlyphAtlas GlyphAtlas;
+
+// Rasterizes the glyphs of the font into a new atlas. Terminates the program on failure.
+GlyphAtlas *glyph_atlas_create(SDL_Renderer *ren, TTF_Font *font);
+
+// Frees the atlas and its texture. Accepts NULL.
+void glyph_atlas_free(GlyphAtlas *atlas);
+
+// Returns the height of a line of text in pixels.
+int glyph_atlas_line_height(GlyphAtlas const *atlas);
+
+// Returns the width of the UTF-8 string in pixels.
+int glyph_atlas_measure(GlyphAtlas const *atlas, char const *str);
+
+// Draws the UTF-8 string with its top-left corner at (x, y). Returns the covered rectangle.
+SDL_Rect glyph_atlas_render(GlyphAtlas *atlas, char const *str, int x, int y, SDL_Color color);
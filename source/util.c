@@ -13,6 +13,15 @@ void *xalloc(size_t size)
 	return p;
 }
 
+void *xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+	if (!p) {
+		fatal("No memory");
+	}
+	return p;
+}
+
 void def_fatal(char const *file, int line, char const *format, ...)
 {
 	va_list va;
@@ -19,6 +19,10 @@
 // filled with zeroes.
 void *xalloc(size_t size) __attribute__ ((malloc));
 
+// Resizes the memory block pointed to by ptr. Terminates the program if it couldn't allocate
+// enough memory. Unlike xalloc, the newly added memory is not initialized.
+void *xrealloc(void *ptr, size_t size);
+
 // Should be called by the "fatal" macro.
 void def_fatal(char const *file, int line, char const *format, ...) __attribute__ ((format (printf, 3, 4), noreturn));
 